@@ -0,0 +1,179 @@
+#ifndef ARENA
+#define ARENA
+
+#include "common.h"
+#include "block_header.h"
+#include "os.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_NUM_CLASSES ((SMALL_BLOCK + HEDER_SIZE) / ARENA_ALIGN + 1) // one free list per 16 bytes up to SMALL_BLOCK
+
+/**
+ * @brief 超出大块的区域对象单独映射，重置时解除映射
+ */
+struct arena_big_chunk
+{
+    arena_big_chunk *next;
+    size_t map_size;
+    uint64_t _pad;       // keep user data 16 byte aligned
+    block_header header; // arena object in front of the user data
+};
+
+/**
+ * @brief 区域分配器：在CHUNK_SIZE大块上顺序分配，重置或销毁时整体归还
+ *
+ *  The arena object lives in its first chunk, behind the queue_state that links the chunks. Every
+ *  object carries an 8 byte header marked as arena memory, so a stray free() is caught by the
+ *  allocator. With size classes enabled, freed small objects are kept on per class lists and reused
+ *  within the arena. An arena is not thread safe.
+ */
+class arena
+{
+public:
+    /**
+     * @brief 创建区域，区域对象本身放在第一个大块中
+     */
+    static arena *create(bool size_classes)
+    {
+        block_header *first = os::allocate_block_page(CHUNK_SIZE);
+        first->init_as_queue_node();
+
+        arena *a = reinterpret_cast<arena *>(chunk_begin(first));
+        a->_first = first;
+        a->_chunks = nullptr;
+        a->_big = nullptr;
+        a->_size_classes = size_classes;
+        memset(a->_free, 0, sizeof(a->_free));
+        a->_base = chunk_begin(first) + round_up(sizeof(arena));
+        a->_cur = a->_base;
+        a->_end = chunk_end(first);
+        return a;
+    }
+
+    /**
+     * @brief 顺序分配，开启大小类时先从对应的空闲链表中取
+     */
+    char *alloc(size_t s)
+    {
+        size_t need = round_up(s + HEDER_SIZE);
+        if (_size_classes && need / ARENA_ALIGN < ARENA_NUM_CLASSES)
+        {
+            block_header *&list = _free[need / ARENA_ALIGN];
+            if (block_header *h = list)
+            {
+                list = h->as_queue_node().next;
+                return h->data();
+            }
+        }
+
+        if (_cur + need > _end)
+        {
+            if (need > CHUNK_SIZE - (size_t)(chunk_begin(_first) - reinterpret_cast<char *>(_first)))
+                return alloc_big(s);
+            new_chunk();
+        }
+
+        block_header *h = reinterpret_cast<block_header *>(_cur);
+        h->init(need);
+        h->mark_arena();
+        _cur += need;
+        return h->data();
+    }
+
+    /**
+     * @brief 开启大小类时把小对象放回空闲链表，否则什么都不做，内存在重置时回收
+     */
+    void free(char *p)
+    {
+        block_header *h = reinterpret_cast<block_header *>(p - HEDER_SIZE);
+        size_t c = (h->size() + HEDER_SIZE) / ARENA_ALIGN;
+        if (!_size_classes || c == 0 || c >= ARENA_NUM_CLASSES)
+            return;
+        h->as_queue_node().next = _free[c];
+        _free[c] = h;
+    }
+
+    /**
+     * @brief 丢弃所有对象，保留第一个大块。返回其余的大块，由queue_state串联，交给调用者放回recyclebin
+     */
+    block_header *reset()
+    {
+        while (_big)
+        {
+            arena_big_chunk *nxt = _big->next;
+            os::mmap_free(_big, _big->map_size);
+            _big = nxt;
+        }
+
+        block_header *chunks = _chunks;
+        for (block_header *h = chunks; h; h = h->as_queue_node().next)
+            h->init(CHUNK_SIZE);
+
+        _chunks = nullptr;
+        memset(_free, 0, sizeof(_free));
+        _cur = _base;
+        _end = chunk_end(_first);
+        return chunks;
+    }
+
+    /**
+     * @brief 销毁区域，返回包括第一个大块在内的所有大块，之后区域对象不再可用
+     */
+    block_header *destroy()
+    {
+        block_header *chunks = reset();
+        block_header *first = _first;
+        first->init(CHUNK_SIZE);
+        first->as_queue_node().next = chunks; // does not reach the arena object behind it
+        return first;
+    }
+
+private:
+    static size_t round_up(size_t s)
+    {
+        return (s + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    }
+
+    // first object header sits 8 bytes below a 16 byte boundary, so user data stays aligned
+    static char *chunk_begin(block_header *chunk)
+    {
+        return chunk->data() + sizeof(block_header::queue_state);
+    }
+
+    static char *chunk_end(block_header *chunk)
+    {
+        return reinterpret_cast<char *>(chunk) + CHUNK_SIZE;
+    }
+
+    void new_chunk()
+    {
+        block_header *chunk = os::allocate_block_page(CHUNK_SIZE);
+        chunk->init_as_queue_node().next = _chunks;
+        _chunks = chunk;
+        _cur = chunk_begin(chunk);
+        _end = chunk_end(chunk);
+    }
+
+    char *alloc_big(size_t s)
+    {
+        size_t map_size = (s + sizeof(arena_big_chunk) + OS_PAGE_SIZE - 1) & ~(size_t)(OS_PAGE_SIZE - 1);
+        arena_big_chunk *big = reinterpret_cast<arena_big_chunk *>(os::mmap_alloc(map_size));
+        big->next = _big;
+        big->map_size = map_size;
+        big->header.init(HEDER_SIZE);
+        big->header.mark_arena();
+        _big = big;
+        return big->header.data();
+    }
+
+    block_header *_first;  // chunk holding this object
+    block_header *_chunks; // further chunks, newest first
+    arena_big_chunk *_big; // objects too large for a chunk
+    bool _size_classes;
+    block_header *_free[ARENA_NUM_CLASSES]; // freed objects by size class, only with _size_classes
+    char *_base;                            // first object in _first
+    char *_cur;                             // bump pointer
+    char *_end;
+};
+
+#endif
@@ -0,0 +1,193 @@
+/**
+ *   Long running fragmentation benchmark.
+ *
+ *   Runs a sequence of phased workloads and samples RSS, live bytes and the bytes the allocator
+ *   holds from the system once per second. The fragmentation ratio (RSS / live bytes) is printed
+ *   as csv so fc_malloc and glibc runs can be plotted against each other.
+ *
+ *   build:
+ *      g++ -O2 -std=c++17 -I.. -DFC_MALLOC fragmentation_bench.cpp -o frag_fc -lpthread
+ *      g++ -O2 -std=c++17 -I.. fragmentation_bench.cpp -o frag_glibc -lpthread
+ *
+ *   usage: frag_xx [threads] [seconds_per_phase]
+ */
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef FC_MALLOC
+#include "thread.h"
+#define BENCH_NAME "fc_malloc"
+
+static inline void *bench_alloc(size_t s) { return thread_allocator::get()->alloc(s); }
+static inline void bench_free(void *p) { thread_allocator::get()->free(static_cast<char *>(p)); }
+static inline int64_t bench_mapped() { return os::mapped_bytes(); }
+#else
+#include <malloc.h>
+#define BENCH_NAME "glibc"
+
+static inline void *bench_alloc(size_t s) { return ::malloc(s); }
+static inline void bench_free(void *p) { ::free(p); }
+static inline int64_t bench_mapped()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+#endif
+
+#define SLOTS_PER_THREAD (16 * 1024)
+
+enum phase_enum
+{
+    ramp_up = 0,     // grow the live set with small objects
+    shift_sizes = 1, // replace the live set with medium/large objects
+    cross_thread = 2, // free objects allocated by a neighbour thread
+    idle = 3,        // stop touching the heap, the allocator may give memory back
+    shrink = 4,      // drop most of the live set, keep a sparse survivor per span
+    num_phases = 5,
+};
+
+static const char *phase_names[num_phases] = {"ramp_up", "shift_sizes", "cross_thread", "idle", "shrink"};
+
+struct slot
+{
+    void *ptr;
+    size_t size;
+};
+
+struct worker
+{
+    std::mutex lock; // only contended in the cross_thread phase
+    std::vector<slot> slots;
+};
+
+static std::atomic<int> g_phase(ramp_up);
+static std::atomic<bool> g_done(false);
+static std::atomic<int64_t> g_live_bytes(0);
+
+static int64_t rss_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static size_t pick_size(int phase, std::mt19937_64 &rng)
+{
+    switch (phase)
+    {
+    case ramp_up:
+        return 8 + rng() % 320; // small bins
+    case shift_sizes:
+        return 512 + rng() % 8192; // large bins
+    default:
+        return (rng() & 1) ? 8 + rng() % 320 : 512 + rng() % 2048;
+    }
+}
+
+static void replace_slot(slot &s, size_t size)
+{
+    if (s.ptr)
+    {
+        bench_free(s.ptr);
+        g_live_bytes.fetch_sub(s.size, std::memory_order_relaxed);
+    }
+    s.ptr = bench_alloc(size);
+    s.size = size;
+    memset(s.ptr, 0x5a, size); // touch every page so rss tracks live bytes
+    g_live_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+static void release_slot(slot &s)
+{
+    if (!s.ptr)
+        return;
+    bench_free(s.ptr);
+    g_live_bytes.fetch_sub(s.size, std::memory_order_relaxed);
+    s.ptr = nullptr;
+    s.size = 0;
+}
+
+static void run_worker(std::vector<worker> &workers, size_t id)
+{
+    std::mt19937_64 rng(id * 7919 + 1);
+    worker &self = workers[id];
+    worker &neighbour = workers[(id + 1) % workers.size()];
+
+    while (!g_done.load(std::memory_order_relaxed))
+    {
+        int phase = g_phase.load(std::memory_order_relaxed);
+        if (phase == idle)
+        {
+            usleep(10000);
+            continue;
+        }
+
+        worker &target = phase == cross_thread ? neighbour : self;
+        std::lock_guard<std::mutex> guard(target.lock);
+        for (int i = 0; i < 256; i++)
+        {
+            slot &s = target.slots[rng() % SLOTS_PER_THREAD];
+            if (phase == shrink)
+            {
+                // keep one survivor in every 16 slots so spans stay pinned
+                if ((&s - &target.slots[0]) % 16)
+                    release_slot(s);
+            }
+            else
+                replace_slot(s, pick_size(phase, rng));
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(self.lock);
+    for (slot &s : self.slots)
+        release_slot(s);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nthreads = argc > 1 ? atoi(argv[1]) : 8;
+    int phase_seconds = argc > 2 ? atoi(argv[2]) : 120;
+
+    std::vector<worker> workers(nthreads);
+    for (worker &w : workers)
+        w.slots.assign(SLOTS_PER_THREAD, slot{nullptr, 0});
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nthreads; i++)
+        threads.emplace_back(run_worker, std::ref(workers), i);
+
+    printf("allocator,second,phase,rss,live,mapped,fragmentation\n");
+    int second = 0;
+    for (int phase = 0; phase < num_phases; phase++)
+    {
+        g_phase.store(phase, std::memory_order_relaxed);
+        for (int i = 0; i < phase_seconds; i++, second++)
+        {
+            sleep(1);
+            int64_t rss = rss_bytes();
+            int64_t live = g_live_bytes.load(std::memory_order_relaxed);
+            printf("%s,%d,%s,%lld,%lld,%lld,%.3f\n", BENCH_NAME, second, phase_names[phase],
+                   (long long)rss, (long long)live, (long long)bench_mapped(),
+                   live > 0 ? (double)rss / live : 0.0);
+            fflush(stdout);
+        }
+    }
+
+    g_done.store(true);
+    for (std::thread &t : threads)
+        t.join();
+    return 0;
+}
@@ -0,0 +1,174 @@
+/**
+ *   Lifetime segregation benchmark.
+ *
+ *   Every thread allocates a stream of small and large objects. One in LONG_LIVED_EVERY survives
+ *   until the end, the others die after a short window. Afterwards all transient objects are freed
+ *   and the threads park for IDLE_SECONDS, mapped_idle is what the heap still holds then with only
+ *   the survivors live. When the survivors are scattered over the chunks the transient ones used,
+ *   those chunks can not be given back. Then the threads ask for large blocks that only fit if the
+ *   freed space coalesced. The run is repeated with and without FC_LONG_LIVED on the survivors and
+ *   printed as csv.
+ *
+ *   build:
+ *      g++ -O2 -std=c++17 -I.. lifetime_bench.cpp -o lifetime_fc -lpthread
+ *
+ *   usage: lifetime_fc [threads] [objects_per_thread] [hint: 0, 1, or -1 for both]
+ *
+ *   with -1 the second run reuses what the first one left mapped, compare runs of 0 and 1 instead.
+ */
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thread.h"
+
+#define LONG_LIVED_EVERY 20 // one survivor per this many allocations
+#define WINDOW 256          // transient objects alive at the same time per thread
+#define BIG_BLOCK (96 * 1024)
+#define IDLE_SECONDS 2      // long enough for the gc to give back chunks of bins without demand
+
+static std::atomic<int64_t> g_live_bytes(0);
+
+struct object
+{
+    char *ptr;
+    size_t size;
+};
+
+static int64_t rss_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static object alloc_object(size_t size, int flags)
+{
+    object o;
+    o.ptr = thread_allocator::get()->alloc(size, flags);
+    o.size = size;
+    memset(o.ptr, 0x5a, size);
+    g_live_bytes.fetch_add(size, std::memory_order_relaxed);
+    return o;
+}
+
+static void free_object(object &o)
+{
+    thread_allocator::get()->free(o.ptr);
+    g_live_bytes.fetch_sub(o.size, std::memory_order_relaxed);
+    o.ptr = nullptr;
+}
+
+// workers count up in 'arrived' when they finish a phase, the main thread moves them on through 'go'
+struct phase_sync
+{
+    std::atomic<int> arrived{0};
+    std::atomic<int> go{0};
+
+    void wait(int stage)
+    {
+        arrived.fetch_add(1);
+        while (go.load() < stage)
+            usleep(1000);
+    }
+};
+
+static void run_worker(size_t id, size_t objects, bool hint, std::vector<object> &survivors, phase_sync &sync)
+{
+    std::mt19937_64 rng(id * 7919 + 1);
+    std::vector<object> window(WINDOW, object{nullptr, 0});
+
+    // phase 0: mixed lifetimes
+    for (size_t i = 0; i < objects; i++)
+    {
+        size_t size = (rng() & 1) ? 8 + rng() % 320 : 512 + rng() % 4096;
+        if (i % LONG_LIVED_EVERY == 0)
+        {
+            survivors.push_back(alloc_object(size, hint ? FC_LONG_LIVED : 0));
+            continue;
+        }
+        object &slot = window[rng() % WINDOW];
+        if (slot.ptr)
+            free_object(slot);
+        slot = alloc_object(size, 0);
+    }
+    for (object &o : window)
+    {
+        if (o.ptr)
+            free_object(o);
+    }
+
+    // park like an idle thread would, the main thread gives the gc time to coalesce and unmap
+    thread_allocator::get()->flush_caches();
+    sync.wait(1);
+
+    // phase 1: large transient blocks that need coalesced space
+    std::vector<object> big;
+    for (size_t i = 0; i < objects / 64; i++)
+        big.push_back(alloc_object(BIG_BLOCK, 0));
+    sync.wait(2);
+    for (object &o : big)
+        free_object(o);
+}
+
+static void run(size_t nthreads, size_t objects, bool hint)
+{
+    std::vector<std::vector<object>> survivors(nthreads);
+    std::vector<std::thread> threads;
+    phase_sync sync;
+
+    int64_t mapped_before = os::mapped_bytes();
+    for (size_t i = 0; i < nthreads; i++)
+        threads.emplace_back([&, i] {
+            run_worker(i, objects, hint, survivors[i], sync);
+        });
+
+    while (sync.arrived.load() < (int)nthreads)
+        usleep(1000);
+    int64_t mapped_mixed = os::mapped_bytes() - mapped_before;
+    sleep(IDLE_SECONDS);
+    int64_t mapped_idle = os::mapped_bytes() - mapped_before;
+    sync.go.store(1);
+    while (sync.arrived.load() < (int)(2 * nthreads))
+        usleep(1000);
+
+    int64_t live = g_live_bytes.load();
+    int64_t mapped = os::mapped_bytes() - mapped_before;
+    printf("%s,%lld,%lld,%lld,%lld,%lld,%.3f\n", hint ? "long_lived_hint" : "no_hint",
+           (long long)rss_bytes(), (long long)live, (long long)mapped_mixed, (long long)mapped_idle, (long long)mapped,
+           live > 0 ? (double)mapped / live : 0.0);
+    fflush(stdout);
+
+    sync.go.store(2);
+    for (std::thread &t : threads)
+        t.join();
+    for (std::vector<object> &v : survivors)
+    {
+        for (object &o : v)
+            free_object(o);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t nthreads = argc > 1 ? atoi(argv[1]) : 8;
+    size_t objects = argc > 2 ? atoi(argv[2]) : 200000;
+    int hint = argc > 3 ? atoi(argv[3]) : -1;
+
+    printf("mode,rss,live,mapped_after_mixed,mapped_idle,mapped_after_big,mapped_per_live\n");
+    if (hint != 1)
+        run(nthreads, objects, false);
+    if (hint != 0)
+        run(nthreads, objects, true);
+    return 0;
+}
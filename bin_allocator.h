@@ -2,8 +2,12 @@
 #define BIN_ALLOCATOR
 
 #include <cstddef>
+#include <atomic>
 #include "block_header.h"
 #include "garbage_collect.h"
+#include "recycle_bin.h"
+#include "options.h"
+#include "os.h"
 
 class thread_allocator;
 
@@ -18,36 +22,67 @@ protected:
 public:
    bin_allocator()
    {
-      memset(_bin_cache, 0, bin_num + 1);
+      memset(_bin_cache, 0, sizeof(_bin_cache));
    }
 
    void constructor()
    {
-      memset(_bin_cache, 0, bin_num + 1);
+      memset(_bin_cache, 0, sizeof(_bin_cache));
    }
 
    void destructor(garbage_collect &gcollect)
    {
       for (size_t i = 0; i < bin_num + 1; i++)
-         if (_bin_cache[i])
-            gcollect.release(_bin_cache[i]);
+         gcollect.release_batch(_bin_cache[i]);
    }
 
    /**
-    *  @brief 提取一级缓存
+    *  @brief 摘下全部一级缓存，串联成一条以nullptr结尾的链表
+    */
+   block_header *take_caches()
+   {
+      block_header *chain = nullptr;
+      for (size_t i = 0; i < bin_num + 1; i++)
+      {
+         block_header *h = _bin_cache[i];
+         _bin_cache[i] = nullptr;
+         while (h)
+         {
+            block_header *nxt = h->as_queue_node().next;
+            h->as_queue_node().next = chain;
+            chain = h;
+            h = nxt;
+         }
+      }
+      return chain;
+   }
+
+   /**
+    *  @brief 提取一级缓存，一级缓存可以是由queue_state串联的一批内存块
     */
    block_header *fetch_cache(int bin)
    {
       if (_bin_cache[bin])
       {
          block_header *h = _bin_cache[bin];
-         _bin_cache[bin] = nullptr;
+         _bin_cache[bin] = h->as_queue_node().next;
          return h;
       }
       else
          return nullptr;
    }
 
+   /**
+    * @brief 存储从中端取得的一批内存块，一级缓存已占用时返回false
+    */
+   bool store_batch(block_header *h, int bin)
+   {
+      if (_bin_cache[bin] != nullptr)
+         return false;
+      _bin_cache[bin] = h;
+      return true;
+   }
+
    /**
     *  @brief 获取一级缓存
     */
@@ -62,7 +97,7 @@ public:
    /**
     *  @brief 清空一级缓存
     */
-   void *clear_cache(int bin)
+   void clear_cache(int bin)
    {
       _bin_cache[bin] = nullptr;
    }
@@ -82,26 +117,11 @@ public:
    }
 
    /**
-    * @brief 提取中端
+    * @brief 提取中端，一次claim取得一个槽位中的一批内存块
     */
-   block_header *fetch_block_from_middle(recycle_bin &bin)
+   block_header *fetch_block_from_middle(recycle_bin &rb)
    {
-      bool found = false;
-      block_header *ret;
-
-      // this is our one and only atomic 'sync' operation...
-      int64_t claim_pos = rb.claim(1);
-
-      // it will be thread safe, not two threads will access the same queue
-      if (claim_pos <= rb._write_pos)
-      {
-         block_header *h = rb.get_block(claim_pos);
-         if (h)
-         {
-            rb.clear_block(claim_pos); // let gc know we took it.
-            return h;
-         }
-      }
+      return rb.take_batch();
    }
 
    /**
@@ -121,7 +141,7 @@ public:
       if (ret)
       {
          found = true;
-         if (!store(bin, ret))
+         if (!store_batch(ret, bin))
             return ret;
       }
 
@@ -139,7 +159,7 @@ public:
  * @brief 用来分配固定大小内存块
  */
 template <size_t bin_num, size_t pop_size>
-class fixed_bin_allocator : public bin_allocator
+class fixed_bin_allocator : public bin_allocator<bin_num, pop_size>
 {
 protected:
    /**
@@ -147,32 +167,83 @@ protected:
     */
    fixed_block_list<pop_size> _block_list;
 
+   /**
+    * @brief 窃取槽，存放二级缓存放不下的一批块。只有本线程放入，其他线程只能整批取走
+    */
+   std::atomic<block_header *> _steal_slot;
+
 public:
-   fixed_bin_allocator() : _block_list(nullptr) {}
+   fixed_bin_allocator() : _block_list(), _steal_slot(nullptr) {}
 
    void constructor()
    {
-      bin_allocator::constructor();
-      _block_list = nullptr;
+      bin_allocator<bin_num, pop_size>::constructor();
+      _block_list = fixed_block_list<pop_size>();
+      _steal_slot.store(nullptr);
    }
 
    void destructor(garbage_collect &gcollect)
    {
-      bin_allocator::destructor();
-      block_header *h = _block_list.pop_chunk();
-      while (h)
+      for (size_t i = 0; i < bin_num + 1; i++)
+         if (this->_bin_cache[i])
+            gcollect.release(this->_bin_cache[i]);
+
+      // the second cache is already linked by queue_state, hand it over in one go
+      gcollect.release_batch(_block_list.peek());
+      _block_list = fixed_block_list<pop_size>();
+   }
+
+   /**
+    * @brief 摘下整个二级缓存，由queue_state串联
+    */
+   block_header *take_list()
+   {
+      block_header *h = _block_list.peek();
+      _block_list = fixed_block_list<pop_size>();
+      return h;
+   }
+
+   /**
+    * @brief 整批取走窃取槽中的块，本线程和饥饿的其他线程都可以调用
+    */
+   block_header *steal()
+   {
+      if (!_steal_slot.load(std::memory_order_relaxed))
+         return nullptr;
+      return _steal_slot.exchange(nullptr, std::memory_order_acquire);
+   }
+
+   /**
+    * @brief 一批块中keep块放入二级缓存，其余放入窃取槽，槽已占用时全部放入二级缓存
+    */
+   void store_batch_list(block_header *h, size_t keep)
+   {
+      for (size_t i = 0; h; i++)
       {
-         gcollect.release(h);
-         h = _block_list.pop_chunk();
+         // only we make the slot non-null, so a null slot stays ours to fill
+         if (i == keep && !_steal_slot.load(std::memory_order_relaxed))
+         {
+            _steal_slot.store(h, std::memory_order_release);
+            return;
+         }
+         block_header *nxt = h->as_queue_node().next;
+         store_list(h);
+         h = nxt;
       }
    }
 
    /**
-    * @brief 提取二级缓存
+    * @brief 提取二级缓存。合并后切剩的尾部不够pop_size，去掉单元块标记交给垃圾回收器
     */
-   block_header *fetch_list()
+   block_header *fetch_list(garbage_collect &gcollect)
    {
-      return _block_list.pop();
+      block_header *h;
+      while ((h = _block_list.pop()) && (size_t)h->size() < pop_size)
+      {
+         h->unset_state((block_header::flags_enum)(block_header::alignblock | block_header::metablock));
+         gcollect.release(h);
+      }
+      return h;
    }
 
    /**
@@ -188,15 +259,15 @@ public:
     */
    block_header *get_cache(int bin)
    {
-      return bin_allocator::get_cache(bin);
+      return bin_allocator<bin_num, pop_size>::get_cache(bin);
    }
 
    /**
     *  @brief 清空一级缓存
     */
-   void *clear_cache(int bin)
+   void clear_cache(int bin)
    {
-      bin_allocator::clear_cache(int bin);
+      bin_allocator<bin_num, pop_size>::clear_cache(bin);
    }
 
    /**
@@ -204,7 +275,7 @@ public:
     */
    bool store_cache(block_header *h, int bin)
    {
-      return bin_allocator::store_cache(h, bin);
+      return bin_allocator<bin_num, pop_size>::store_cache(h, bin);
    }
 
    /**
@@ -212,48 +283,51 @@ public:
     */
    block_header *fetch_block_from_middle(recycle_bin &bin)
    {
-      return bin_allocator::fetch_block_from_middle(bin);
+      return bin_allocator<bin_num, pop_size>::fetch_block_from_middle(bin);
    }
 
-   block_header *fetch_block_from_second_cache_above(int bin, recycle_bin &rbin, garbage_collector &gcollect, block_header::flags_enum flag, size_t chunk_size, size_t list_cache_num)
+   template <typename steal_fn>
+   block_header *fetch_block_from_second_cache_above(recycle_bin &rbin, garbage_collect &gcollect, block_header::flags_enum flag, size_t chunk_size, size_t list_cache_num, steal_fn steal_from_others)
    {
       //提取二级缓存
       block_header *h;
-      h = fetch_list();
+      h = fetch_list(gcollect);
       if (h)
          return h;
 
-      //从中端尝试提取四块
-      bool found = false;
-      for (size_t i = 0; i < list_cache_num - 1; i++)
-      {
-         h = fetch_block_from_middle();
-         if (h)
-         {
-            store_cache(h);
-            found = true;
-         }
-      }
-      h = fetch_block_from_middle();
+      //先收回自己窃取槽中的块，再从中端提取一批放入二级缓存，只需一次原子操作
+      h = steal();
+      if (!h)
+         h = fetch_block_from_middle(rbin);
+
+      //慢速路径：ring_buffer为空，直接从gc缓存中取，或等待gc生产，都失败才映射新内存
+      if (!h)
+         h = rbin.pull_cached_batch(options::get(FC_OPT_REFILL_SPINS));
+      if (!h)
+         h = rbin.wait_for_batch(options::get(FC_OPT_REFILL_WAIT_US));
+
+      //全局池也空了，从其他线程的窃取槽中取
+      if (!h)
+         h = steal_from_others();
+
+      store_batch_list(h, list_cache_num);
+      h = fetch_list(gcollect);
       if (h)
          return h;
-      else if (found == true)
-         return fetch_list();
 
       //从后端提取大块
       block_header *new_page = os::allocate_block_page(chunk_size);
       new_page->set_state(flag);
 
       //分割大块到缓存中
-      block_header *p = new_page;
-      block_header *tail = new_page->split_after(SMALL_BIN_SIZE);
+      block_header *tail = new_page->split_after(pop_size);
 
       for (size_t i = 0; i < list_cache_num - 1; i++)
       {
          store_list(tail);
          tail = tail->split_after(pop_size);
       }
-      _garbage_collect.release(tail);
+      gcollect.release(tail);
 
       return new_page;
    }
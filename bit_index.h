@@ -15,6 +15,13 @@ public:
         return _bits == 0 ? 64 : LZERO(_bits);
     }
     
+    // first set bit at or after pos, 64 if there is none
+    uint64_t first_set_bit_from(uint64_t pos) const
+    {
+        uint64_t bits = pos >= 64 ? 0 : _bits & (~0ull >> pos);
+        return bits == 0 ? 64 : LZERO(bits);
+    }
+
     bool get(uint64_t pos) const { return _bits & (1ll << (63 - pos)); }
 
     void set(uint64_t pos)
@@ -36,4 +43,6 @@ public:
     void clear_all() { _bits = 0; }
 
     bool empty() { return _bits == 0; }
+
+    uint64_t bits() const { return _bits; }
 };
\ No newline at end of file
@@ -11,7 +11,7 @@ public:
    block_header *next()
    {
       if (_size > 0)
-         return reinterpret_cast<block_header *>(data() + _size);
+         return reinterpret_cast<block_header *>(data() + size());
       else
          return nullptr;
    }
@@ -31,6 +31,7 @@ public:
       bigdata = 2,
       alignblock = 4,
       metablock = 8,
+      longlived = 16, // from the chunks of long lived allocations
    };
 
    flags_enum get_state() { return (flags_enum)_flags; }
@@ -53,24 +54,64 @@ public:
 
    bool is_mergable()
    {
-      return (_flags &= mergable) != 0;
+      return (_flags & mergable) != 0;
    }
 
    bool is_bigdata()
    {
-      return (_flags &= bigdata) != 0;
+      return (_flags & bigdata) != 0;
    }
 
    bool is_aligned()
    {
-      return (_flags &= alignblock) != 0;
+      return (_flags & alignblock) != 0;
    }
 
    bool is_meta()
    {
-      return (_flags &= metablock) != 0;
+      return (_flags & metablock) != 0;
    }
 
+   bool is_longlived()
+   {
+      return (_flags & longlived) != 0;
+   }
+
+   // arena objects carry bigdata | alignblock, a combination no other block uses
+   void mark_arena()
+   {
+      _flags |= bigdata | alignblock;
+   }
+
+   bool is_arena()
+   {
+      return (_flags & (bigdata | alignblock)) == (bigdata | alignblock);
+   }
+
+   // the block covers the whole page it was mapped as, see os::allocate_block_page
+   bool is_whole_page() const { return _prev_size == 0 && _size < 0; }
+
+   // an aligned pointer inside a medium or huge block gets a header with bigdata | metablock in front of it,
+   // _prev_size holds the distance back to the data of the block that was allocated
+   void mark_offset(int off)
+   {
+      _prev_size = off;
+      _size = 0;
+      _tag = 0;
+      _flags = bigdata | metablock;
+   }
+
+   bool is_offset()
+   {
+      return (_flags & (bigdata | metablock)) == (bigdata | metablock);
+   }
+
+   char *offset_base() { return data() - _prev_size; }
+
+   // allocation tag of a block in use, kept next to _size and _flags, which only the owner writes
+   int get_tag() const { return _tag; }
+   void set_tag(int t) { _tag = t; }
+
    queue_state &as_queue_node()
    {
       return *reinterpret_cast<queue_state *>(data());
@@ -87,23 +128,34 @@ public:
    void init(int s)
    {
       _prev_size = 0;
-      _size = -(s - 8);
+      _tag = 0;
+      _size = -((s - 8) >> SIZE_SHIFT);
+      _flags = 0;
    }
 
    char *data() { return ((char *)this) + 8; } //return data ptr
-   int size() const { return abs(_size); }     //return size of data
+   int size() const { return abs(_size) << SIZE_SHIFT; } //return size of data
 
    // split a block, create a new block at p and return it
    block_header *split_after(int s)
    {
       block_header *n = reinterpret_cast<block_header *>(data() + s);
       n->_prev_size = s;
-      n->_size = size() - s - 8;
+      n->_size = (size() - s - 8) >> SIZE_SHIFT;
+      n->_tag = 0;
+      // a chunk serves one lifetime class, and span and meta chunks are only cut at span or leaf
+      // boundaries, so their pieces stay spans or leaves. fetch_list drops the flag from a too short rest
+      n->_flags = _flags & (longlived | alignblock | metablock);
 
       if (_size < 0) //tail block of the page
          n->_size = -n->_size;
 
-      _size = s;
+      _size = s >> SIZE_SHIFT;
+
+      // the block behind us now follows n
+      block_header *nn = n->next();
+      if (nn)
+         nn->_prev_size = n->size();
       return n;
    }
 
@@ -113,10 +165,17 @@ public:
       block_header *nxt = next();
       if (!nxt || !nxt->is_mergable())
          return this;
+      return absorb_next();
+   }
+
+   // merge this block with next without looking at its state, the caller owns both.
+   block_header *absorb_next()
+   {
+      block_header *nxt = next();
 
       //update __size of this
-      _size += nxt->size() + 8;
-      if (nxt->_size < 0)
+      _size = (size() + nxt->size() + 8) >> SIZE_SHIFT;
+      if (nxt->_size < 0) // nxt was the tail of the page
          _size = -_size;
 
       //update _prev_size of next block
@@ -140,9 +199,16 @@ public:
    }
 
 private:
+   // sizes are multiples of 8 and _size keeps them in 8 byte units
+   enum { SIZE_SHIFT = 3 };
+
+   // _prev_size is written by the owner of the previous block, the other word only by our owner
    int32_t _prev_size; // offset to previous header.
-   int32_t _size : 28; // offset to next, negitive indicates tail, 2 GB max
-   int32_t _flags : 4;
+   int32_t _size : 23; // offset to next in 8 byte units, negitive indicates tail, 32 MB max
+   uint32_t _tag : 4;  // see fc_set_tag
+   uint32_t _flags : 5;
 };
 
+static_assert(sizeof(block_header) == 8, "block header must stay 8 bytes");
+
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef BLOCK_LIST
 #define BLOCK_LIST
 
+#include "common.h"
 #include "block_header.h"
 #include <unistd.h>
 class thread_allocator;
@@ -33,7 +34,7 @@ public:
 
     block_header *pop()
     {
-        if (empty)
+        if (empty())
             return nullptr;
 
         block_header *head = _free_list;
@@ -55,6 +56,8 @@ public:
         if (prev_header == nullptr) //head node
         {
             _free_list = next_header;
+            if (next_header)
+                next_header->as_queue_node().prev = nullptr;
         }
         else
         {
@@ -69,6 +72,69 @@ public:
         return _free_list;
     }
 
+    /**
+     * @brief 按地址对由queue_state.next串联的链表归并排序，返回新表头，prev不再有效
+     */
+    static block_header *sort_by_address(block_header *h)
+    {
+        if (!h || !h->as_queue_node().next)
+            return h;
+
+        block_header *slow = h;
+        block_header *fast = h->as_queue_node().next;
+        while (fast && fast->as_queue_node().next)
+        {
+            slow = slow->as_queue_node().next;
+            fast = fast->as_queue_node().next->as_queue_node().next;
+        }
+        block_header *right = slow->as_queue_node().next;
+        slow->as_queue_node().next = nullptr;
+
+        block_header *l = sort_by_address(h);
+        block_header *r = sort_by_address(right);
+        block_header *head = nullptr;
+        block_header **tail = &head;
+        while (l && r)
+        {
+            block_header *&least = l < r ? l : r;
+            *tail = least;
+            tail = &least->as_queue_node().next;
+            least = least->as_queue_node().next;
+        }
+        *tail = l ? l : r;
+        return head;
+    }
+
+    /**
+     * @brief 合并已按地址排序的链表中物理相邻的块，返回剩下的块数
+     */
+    static size_t coalesce_adjacent(block_header *h)
+    {
+        return coalesce_adjacent(h, [](block_header *, block_header *) { return true; });
+    }
+
+    /**
+     * @brief 同上，只有can_merge(h, nxt)为真时才合并
+     */
+    template <typename F>
+    static size_t coalesce_adjacent(block_header *h, F can_merge)
+    {
+        size_t num = 0;
+        while (h)
+        {
+            block_header *nxt = h->as_queue_node().next;
+            if (nxt && h->next() == nxt && can_merge(h, nxt))
+            {
+                h->as_queue_node().next = nxt->as_queue_node().next;
+                h->absorb_next(); // stay on h, it may reach the one after too
+                continue;
+            }
+            num++;
+            h = nxt;
+        }
+        return num;
+    }
+
 protected:
     block_header *_free_list;
 };
@@ -76,11 +142,13 @@ protected:
 template <size_t pop_size>
 class fixed_block_list : public block_list
 {
+public:
     block_header *pop()
     {
         block_header *head = block_list::pop();
 
-        if (head && head->size() > pop_size)
+        // a rest too small for a queue_state stays with the head, it would overwrite the next header
+        if (head && (size_t)head->size() >= pop_size + HEDER_SIZE + sizeof(block_header::queue_state))
             push(head->split_after(pop_size));
 
         return head;
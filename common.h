@@ -29,8 +29,56 @@
 #define SMALL_BLOCK 336
 #define LARGE_BLOCK CHUNK_SIZE
 
+#define OS_PAGE_SIZE 4096
+
+#define HUGE_CACHE_NUM 16                            // freed huge mappings kept for reuse
+#define HUGE_CACHE_BYTES (1024ll * 1024 * 1024)      // address space the huge cache may keep mapped
+#define HUGE_CACHE_COMMIT_BYTES (256ll * 1024 * 1024) // resident bytes kept before decommitting
+
+#define MEDIUM_BLOCK (32 * 1024 * 1024)              // blocks up to this size are page runs of the medium heap
+#define MEDIUM_REGION_SIZE (64ll * 1024 * 1024)      // address space reserved at once by the medium heap
+#define MEDIUM_REGION_PAGES (MEDIUM_REGION_SIZE / OS_PAGE_SIZE)
+#define MEDIUM_DECOMMIT_PAGES 16                     // free runs longer than this are decommitted when idle
+#define MEDIUM_FIT_SCAN 16                           // runs examined for a best fit in one free list
+
+#define HEAP_SOFT_LIMIT_PCT 90                        // soft heap limit taken from the cgroup limit, in percent
+#define HEAP_PRESSURE_PCT 80                          // caches start to shrink at this percentage of the soft limit
+#define CGROUP_V2_PATH "/sys/fs/cgroup/memory.max"
+#define CGROUP_V1_PATH "/sys/fs/cgroup/memory/memory.limit_in_bytes"
+#define CGROUP_UNLIMITED (1ll << 60)                  // cgroup v1 reports no limit as a huge number
+
+#define COMPACT_REGION_SIZE (4ll * 1024 * 1024 * 1024) // address space of a compact heap created with size 0
+
 #define QUEUE_SIZE 128
 
+#define RING_MIN_LEVEL 0      // lowest number of batches a ring_buffer is asked to hold
+#define RING_EWMA_ALPHA 0.125 // weight of the newest pass in the demand forecast
+#define RING_HEADROOM 2       // passes of forecast demand kept published
+#define RING_SHRINK_PASSES 64 // passes the forecast must stay low before the level shrinks
+#define IDLE_UNMAP_PASSES 256  // passes without demand after which a bin unmaps its cached whole chunks
+
 #define LIST_CACHE_NUM 4
+#define FREE_BUFFER_NUM 32 // small frees a thread buffers before applying them span by span
+#define NODE_BATCH_NUM 16  // nodes fc_node_allocator takes from the thread allocator at once
+#define RETIRE_BATCH_NUM 64 // retired objects a thread collects before handing them to the gc thread
+#define ON_DECK_SCAN 64     // own frees not yet taken by the gc a thread looks at before mapping
+
+#define DEFRAG_STATS_MS 100    // how often the gc thread refreshes the utilization of the small classes
+#define DEFRAG_SPARSE_RATIO 4  // a span is sparse when at most 1/DEFRAG_SPARSE_RATIO of its slots are used
+#define DEFRAG_MAX_UTIL_PCT 75 // objects are worth moving only while their class is less utilized than this
+#define TAG_CHECK_MS 100       // how often the gc thread sums the tag counters and checks their soft limits
+
+#define REFILL_SPINS 64  // default of FC_OPT_REFILL_SPINS
+#define REFILL_WAIT_US 0 // default of FC_OPT_REFILL_WAIT_US
+
+#define GC_WORK_BUDGET 4096     // default of FC_OPT_GC_WORK_BUDGET
+#define GC_TIME_BUDGET_US 1000  // default of FC_OPT_GC_TIME_BUDGET_US
+#define INLINE_COALESCE 0       // default of FC_OPT_INLINE_COALESCE
+#define DEFERRED_COALESCE 0     // default of FC_OPT_DEFERRED_COALESCE
+#define THREAD_IDLE_MS 1000     // default of FC_OPT_THREAD_IDLE_MS
+#define STEAL_VICTIMS 4         // default of FC_OPT_STEAL_VICTIMS
+
+#define TRANSFER_BATCH_NUM 16            // max blocks the gc publishes in one ring_buffer slot
+#define TRANSFER_BATCH_BYTES (16 * 1024) // max bytes of one batch, the first block is always taken
 
 #endif
\ No newline at end of file
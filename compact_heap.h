@@ -0,0 +1,188 @@
+#ifndef COMPACT_HEAP
+#define COMPACT_HEAP
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include "common.h"
+#include "block_header.h"
+#include "size_map.h"
+#include "spin_lock.h"
+#include "fc_malloc.h"
+#include "os.h"
+
+#define COMPACT_MAX_REGION ((1ull << 32) << FC_COMPACT_SHIFT) // the largest region 32 bit offsets can address
+#define COMPACT_LARGE_CHUNK 0xff                              // chunk class of chunks cut into large objects
+
+/**
+ * @brief 紧凑堆的分配游标，指向当前大块中下一个可用位置
+ */
+struct compact_cursor
+{
+    char *pos;
+    char *end;
+};
+
+/**
+ * @brief 紧凑堆中一个大小类的空闲链表和小块游标，各用自己的锁，占满一个缓存行
+ */
+struct compact_class
+{
+    spin_lock lock;
+    char *free;            // freed objects, linked through their first word
+    compact_cursor cursor; // small classes only, large objects share compact_heap::_large_cursor
+    uint64_t pad[4];       // classes should not false-share their locks
+};
+static_assert(sizeof(compact_class) == 64, "one cache line per class");
+
+/**
+ * @brief 紧凑堆：整个堆位于一段预留的地址空间中，对象可用相对区域首地址的32位偏移表示
+ *
+ *  The heap object sits at the start of its region, so offset 0 is never an object and stands for
+ *  NULL. It is followed by one byte per CHUNK_SIZE chunk holding the chunk's size class. Small objects
+ *  are cut from chunks of their own class and carry no header, large objects carry a block_header and
+ *  share chunks. Every object is rounded up to its size class and freed objects are kept on per class
+ *  lists, each class under its own lock. Chunks are never given back before the heap is destroyed,
+ *  the metadata pages and every chunk handed out count as mapped.
+ */
+class compact_heap
+{
+public:
+    /**
+     * @brief 预留区域并在其首部构造堆，region_bytes为0时使用COMPACT_REGION_SIZE
+     */
+    static compact_heap *create(size_t region_bytes)
+    {
+        if (region_bytes == 0)
+            region_bytes = COMPACT_REGION_SIZE;
+        if (region_bytes > COMPACT_MAX_REGION)
+            region_bytes = COMPACT_MAX_REGION;
+        region_bytes = (region_bytes + CHUNK_SIZE - 1) & ~(size_t)(CHUNK_SIZE - 1);
+
+        char *base = os::reserve(region_bytes);
+        return new (base) compact_heap(region_bytes);
+    }
+
+    /**
+     * @brief 解除整个区域的映射，堆中的所有对象随之失效
+     */
+    void destroy()
+    {
+        os::unreserve(this, _region_bytes, _meta_bytes + (std::min(_next_chunk.load(), _num_chunks) - _first_chunk) * CHUNK_SIZE);
+    }
+
+    /**
+     * @brief 分配对象，区域用完或超出大块时返回nullptr
+     */
+    char *alloc(size_t s)
+    {
+        if (s < MIN_BLOCK_SIZE)
+            s = MIN_BLOCK_SIZE;
+        bool small = s <= SMALL_BLOCK;
+        size_t need = small ? s : s + HEDER_SIZE;
+        if (need > CHUNK_SIZE)
+            return nullptr;
+        size_t bin = _smap.get_sizeclass(need);
+
+        compact_class &c = _classes[bin];
+        size_t bytes = kSizeClasses[bin].size;
+        char *p;
+        {
+            std::lock_guard<spin_lock> guard(c.lock);
+            if ((p = c.free))
+            {
+                c.free = *reinterpret_cast<char **>(p);
+                return p;
+            }
+
+            //小块每个大小类有自己的大块
+            if (small)
+                return cut(c.cursor, bytes, bin);
+        }
+
+        //大块对象共用一个游标
+        {
+            std::lock_guard<spin_lock> guard(_large_lock);
+            p = cut(_large_cursor, bytes, COMPACT_LARGE_CHUNK);
+        }
+        if (!p)
+            return nullptr;
+
+        block_header *h = reinterpret_cast<block_header *>(p);
+        h->init(bytes);
+        return h->data();
+    }
+
+    /**
+     * @brief 释放对象到所在大小类的空闲链表
+     */
+    void free(char *p)
+    {
+        size_t bin = chunk_classes()[(p - reinterpret_cast<char *>(this)) / CHUNK_SIZE];
+        if (bin == COMPACT_LARGE_CHUNK)
+            bin = _smap.get_sizeclass(reinterpret_cast<block_header *>(p - HEDER_SIZE)->size() + HEDER_SIZE);
+
+        compact_class &c = _classes[bin];
+        std::lock_guard<spin_lock> guard(c.lock);
+        *reinterpret_cast<char **>(p) = c.free;
+        c.free = p;
+    }
+
+private:
+    explicit compact_heap(size_t region_bytes)
+        : _region_bytes(region_bytes), _num_chunks(region_bytes / CHUNK_SIZE)
+    {
+        // the chunk classes behind us are zero, fresh anonymous memory
+        size_t meta = sizeof(compact_heap) + _num_chunks;
+        _first_chunk = (meta + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        _next_chunk.store(_first_chunk, std::memory_order_relaxed);
+        _meta_bytes = (meta + OS_PAGE_SIZE - 1) & ~(size_t)(OS_PAGE_SIZE - 1);
+        os::commit(_meta_bytes);
+        memset(static_cast<void *>(_classes), 0, sizeof(_classes));
+        memset(&_large_cursor, 0, sizeof(_large_cursor));
+    }
+
+    uint8_t *chunk_classes()
+    {
+        return reinterpret_cast<uint8_t *>(this + 1);
+    }
+
+    /**
+     * @brief 从游标切下bytes字节，大块用完时换一个新的，区域用完返回nullptr。调用者持有游标的锁
+     */
+    char *cut(compact_cursor &cur, size_t bytes, size_t chunk_class)
+    {
+        if (cur.pos + bytes > cur.end && !new_chunk(cur, chunk_class))
+            return nullptr;
+        char *p = cur.pos;
+        cur.pos += bytes;
+        return p;
+    }
+
+    /**
+     * @brief 从区域中取下一个大块交给游标并计入映射，当前大块剩下的尾部不再使用
+     */
+    bool new_chunk(compact_cursor &cur, size_t chunk_class)
+    {
+        size_t chunk = _next_chunk.fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= _num_chunks)
+            return false;
+        os::commit(CHUNK_SIZE);
+        chunk_classes()[chunk] = chunk_class;
+        cur.pos = reinterpret_cast<char *>(this) + chunk * CHUNK_SIZE;
+        cur.end = cur.pos + CHUNK_SIZE;
+        return true;
+    }
+
+    size_t _region_bytes;
+    size_t _num_chunks;
+    size_t _first_chunk;              // first chunk behind the metadata
+    size_t _meta_bytes;               // pages of the heap object and the chunk classes, counted as mapped
+    std::atomic<size_t> _next_chunk;  // first chunk never handed out, may run past _num_chunks
+    spin_lock _large_lock;            // guards _large_cursor
+    compact_cursor _large_cursor;     // chunk large objects are cut from
+    compact_class _classes[kNumClasses]; // free lists by size class, and cursors of the small classes
+    sizemap _smap;
+};
+
+#endif
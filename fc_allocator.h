@@ -0,0 +1,135 @@
+#ifndef FC_ALLOCATOR
+#define FC_ALLOCATOR
+
+#include <cstddef>
+#include <new>
+#include <memory_resource>
+#include "thread.h"
+
+/**
+ * @brief std::pmr内存资源，直接调用本线程的分配器，释放时带上大小
+ *
+ *  Alignments above MIN_BLOCK_SIZE are served by thread_allocator::alloc_aligned, from a small class
+ *  up to 16 bytes, by carving a large block, or at an aligned pointer inside a medium or huge block.
+ */
+class fc_memory_resource : public std::pmr::memory_resource
+{
+public:
+    static fc_memory_resource *get()
+    {
+        static fc_memory_resource resource;
+        return &resource;
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        return thread_allocator::get()->alloc_aligned(bytes ? bytes : 1, alignment);
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        thread_allocator::thread_free_sized(static_cast<char *>(p), bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+/**
+ * @brief STL分配器，无状态，释放时带上大小
+ */
+template <typename T>
+class fc_stl_allocator
+{
+public:
+    typedef T value_type;
+
+    fc_stl_allocator() noexcept {}
+
+    template <typename U>
+    fc_stl_allocator(const fc_stl_allocator<U> &) noexcept {}
+
+    T *allocate(size_t n)
+    {
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::bad_alloc();
+        return reinterpret_cast<T *>(thread_allocator::get()->alloc_aligned(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, size_t n) noexcept
+    {
+        thread_allocator::thread_free_sized(reinterpret_cast<char *>(p), n * sizeof(T), alignof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const fc_stl_allocator<T> &, const fc_stl_allocator<U> &) noexcept { return true; }
+
+template <typename T, typename U>
+bool operator!=(const fc_stl_allocator<T> &, const fc_stl_allocator<U> &) noexcept { return false; }
+
+/**
+ * @brief 节点容器的分配器，单个节点从线程本地的一批中取，一批NODE_BATCH_NUM个一次分配
+ */
+template <typename T>
+class fc_node_allocator
+{
+public:
+    typedef T value_type;
+
+    fc_node_allocator() noexcept {}
+
+    template <typename U>
+    fc_node_allocator(const fc_node_allocator<U> &) noexcept {}
+
+    T *allocate(size_t n)
+    {
+        if (n != 1 || alignof(T) > MIN_BLOCK_SIZE)
+            return fc_stl_allocator<T>().allocate(n);
+
+        node_batch &b = batch();
+        if (b.num == 0)
+        {
+            thread_allocator::get()->alloc_batch(sizeof(T), NODE_BATCH_NUM, b.nodes);
+            b.num = NODE_BATCH_NUM;
+        }
+        return reinterpret_cast<T *>(b.nodes[--b.num]);
+    }
+
+    void deallocate(T *p, size_t n) noexcept
+    {
+        fc_stl_allocator<T>().deallocate(p, n);
+    }
+
+private:
+    struct node_batch
+    {
+        char *nodes[NODE_BATCH_NUM];
+        size_t num = 0;
+
+        ~node_batch()
+        {
+            while (num)
+                thread_allocator::thread_free_sized(nodes[--num], sizeof(T));
+        }
+    };
+
+    static node_batch &batch()
+    {
+        // create the thread allocator first so it is destroyed after the batch
+        thread_allocator::get();
+        static thread_local node_batch b;
+        return b;
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const fc_node_allocator<T> &, const fc_node_allocator<U> &) noexcept { return true; }
+
+template <typename T, typename U>
+bool operator!=(const fc_node_allocator<T> &, const fc_node_allocator<U> &) noexcept { return false; }
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef FC_MALLOC_API
+#define FC_MALLOC_API
+
+#include <stddef.h>
+#include <stdint.h>
+
+// flags for fc_malloc_flags
+#define FC_POPULATE 1   // prefault the pages of huge allocations, for latency critical callers
+#define FC_LONG_LIVED 2 // small and large blocks come from spans and chunks kept apart from short lived ones
+#define FC_TRANSIENT 4  // overrides a long lived scope set by fc_set_lifetime
+
+// flags for fc_arena_create
+#define FC_ARENA_SIZE_CLASSES 1 // fc_arena_free keeps small objects for reuse within the arena
+
+// flags for fc_warmup
+#define FC_WARMUP_WATERMARK 1 // the gc thread keeps the shared caches of the profile's classes topped up
+
+// options for fc_malloc_set_option
+#define FC_OPT_REFILL_SPINS 0   // tries to take a bin's lock when a starving thread pulls from it directly
+#define FC_OPT_REFILL_WAIT_US 1 // microseconds a starving thread waits for the gc before mapping, 0 disables
+#define FC_OPT_GC_WORK_BUDGET 2    // freed blocks the gc thread processes per pass
+#define FC_OPT_GC_TIME_BUDGET_US 3 // microseconds the gc thread spends on garbage per pass
+#define FC_OPT_INLINE_COALESCE 4   // on-deck length at which a thread coalesces its own garbage, 0 disables
+#define FC_OPT_DEFERRED_COALESCE 5 // 1: the gc sorts each pass's garbage by address and merges it in one sweep
+#define FC_OPT_THREAD_IDLE_MS 6    // a thread that did not allocate for this long flushes its caches, 0 disables
+#define FC_OPT_STEAL_VICTIMS 7     // threads a starving thread probes for spans before mapping, 0 disables
+#define FC_OPT_NUM 8
+
+#define FC_MAX_TAGS 16 // allocation tags are 0 to 15, 0 is the tag of untagged code
+
+// a heap not bound to any thread, see fc_heap_create
+typedef struct fc_heap fc_heap_t;
+
+// objects allocated by bumping a pointer and released all at once, see fc_arena_create
+typedef struct fc_arena fc_arena_t;
+
+// a heap inside one reserved region whose objects have 32 bit handles, see fc_compact_create
+typedef struct fc_compact fc_compact_t;
+
+#define FC_COMPACT_SHIFT 3 // handles count 8 byte units, so a compact region spans at most 32 GB
+
+// per recycle bin state chosen by the gc thread, see fc_malloc_bin_stats
+struct fc_bin_stats
+{
+    int64_t level;     // batches the gc keeps published in the ring
+    int64_t available; // batches published right now
+    double demand;     // forecast of claims per gc pass
+};
+
+// hit rate of fc_alloc_near, summed over all threads
+struct fc_near_stats
+{
+    uint64_t hits;   // placed in the hint's span or in a free block next to the hint
+    uint64_t misses; // served by the normal path
+};
+
+// heap usage of one allocation tag, summed over all threads, see fc_set_tag
+struct fc_tag_stats
+{
+    int64_t live_bytes; // bytes of live objects, rounded up to their size class or block
+    uint64_t allocs;    // allocations since start
+    uint64_t frees;
+};
+
+// one size class of a warm-up profile, see fc_warmup
+struct fc_warmup_class
+{
+    size_t size;  // object size
+    size_t count; // objects the thread expects to have live at once
+};
+
+// called before the heap maps more memory while that takes it above the soft limit, see fc_set_heap_limit
+typedef void (*fc_heap_limit_fn)(int64_t mapped_bytes, size_t request, int64_t limit, void *arg);
+
+// called from the gc thread when a tag's live bytes rise above its soft limit, once per crossing
+typedef void (*fc_tag_limit_fn)(int tag, int64_t live_bytes, int64_t limit, void *arg);
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    void *fc_malloc_flags(size_t size, int flags);
+
+    // returns 0 on success, -1 for an unknown option
+    int fc_malloc_set_option(int option, int64_t value);
+
+    // fills at most n entries: the large bins in size order, then the span bin and the meta bin,
+    // then the long lived large bins and the long lived span bin. returns the number of bins.
+    size_t fc_malloc_bin_stats(struct fc_bin_stats *out, size_t n);
+
+    // gives the calling thread's cached free blocks and its frees the gc thread has not taken yet back
+    // to the global pool, e.g. before parking it.
+    void fc_thread_cache_flush(void);
+
+    // sets the lifetime class (FC_LONG_LIVED or 0) of the calling thread's allocations that do not
+    // pass one, returns the previous one.
+    int fc_set_lifetime(int flags);
+
+    // allocates size bytes close to hint: in the span holding hint when the calling thread allocates
+    // from it, or from a free span or block right next to it. falls back to fc_malloc_flags(size, 0).
+    // hint must come from an allocation of the same kind, small (<= 336 bytes) or large.
+    void *fc_alloc_near(const void *hint, size_t size);
+
+    void fc_alloc_near_stats(struct fc_near_stats *out);
+
+    // sets the tag charged for the calling thread's allocations and returns the previous one.
+    // large blocks record the tag in their header. small objects are charged to the tag of their
+    // span, which is the tag of the thread that took the span. returns -1 for a tag out of range.
+    int fc_set_tag(int tag);
+
+    // returns -1 for a tag out of range
+    int fc_tag_get_stats(int tag, struct fc_tag_stats *out);
+
+    // soft limit on the live bytes of tag, 0 removes it. the gc thread checks the limits every
+    // TAG_CHECK_MS and calls the callback, which should not block, so the owner can throttle the tag.
+    int fc_tag_set_limit(int tag, int64_t bytes);
+
+    void fc_tag_set_limit_callback(fc_tag_limit_fn fn, void *arg);
+
+    // soft limit on the bytes mapped from the system, 0 removes it. near the limit the rings and
+    // thread caches shrink and the gc thread gives memory back eagerly. the mapping that would cross
+    // the limit calls the callback first, in the mapping thread, and then still goes ahead. the
+    // callback runs inside the allocator and must not allocate or free.
+    void fc_set_heap_limit(int64_t bytes);
+
+    int64_t fc_get_heap_limit(void);
+
+    // sets the soft limit to 90% of the cgroup memory limit read from path, or from the cgroup v2 and
+    // then the v1 file when path is NULL, which is done at startup. returns the limit, 0 for none.
+    int64_t fc_set_heap_limit_from_cgroup(const char *path);
+
+    void fc_set_heap_limit_callback(fc_heap_limit_fn fn, void *arg);
+
+    // returns 1 when p is a small object in a sparsely used span and its size class has room in denser
+    // spans, so moving p with fc_alloc_for_move helps that span to empty out and go back to the system.
+    // meant for incremental defragmentation of long lived caches, the answer is only a hint.
+    int fc_should_move(const void *p);
+
+    // allocates size bytes for an object being moved, filling the densest span the calling thread can
+    // allocate from. free the old copy as usual after moving.
+    void *fc_alloc_for_move(size_t size);
+
+    // allocates, touches and frees count objects of every class of the profile in the calling thread,
+    // so its front and second level caches hold prefaulted spans and blocks. with FC_WARMUP_WATERMARK
+    // the gc thread also keeps enough batches of the small and large classes published, mapping and
+    // cutting chunks itself when its caches run dry, so the thread does not map on its hot path.
+    // the batches go to the long lived caches when the thread's default lifetime is FC_LONG_LIVED.
+    // for medium and huge classes the prefaulted pages stay committed in the caches instead of being
+    // trimmed. a count of 0 resets the watermark of the class, small classes share one.
+    void fc_warmup(const struct fc_warmup_class *profile, size_t n, int flags);
+
+    // frees p once every thread taking part in epoch reclamation has announced two quiescent states.
+    // the frees are done in batches by the gc thread.
+    void fc_retire(void *p);
+
+    // the calling thread holds no references into shared lock-free structures right now.
+    // a thread takes part in epoch reclamation from its first call on.
+    void fc_quiescent(void);
+
+    // creates a heap with its own caches, registered with the gc thread like a thread's heap.
+    // a heap is not thread safe: the caller makes sure only one thread uses it at a time.
+    fc_heap_t *fc_heap_create(void);
+
+    // gives the heap's caches back to the global pool, memory allocated from it stays valid.
+    void fc_heap_destroy(fc_heap_t *heap);
+
+    void *fc_heap_alloc(fc_heap_t *heap, size_t size);
+
+    // p may come from any heap or thread.
+    void fc_heap_free(fc_heap_t *heap, void *p);
+
+    // an arena is not thread safe. its objects must not be passed to free(), that aborts.
+    fc_arena_t *fc_arena_create(int flags);
+
+    void *fc_arena_alloc(fc_arena_t *arena, size_t size);
+
+    // only with FC_ARENA_SIZE_CLASSES, otherwise the memory comes back on reset.
+    void fc_arena_free(fc_arena_t *arena, void *p);
+
+    // drops every object, keeps one chunk and gives the others back to the global pool.
+    void fc_arena_reset(fc_arena_t *arena);
+
+    void fc_arena_destroy(fc_arena_t *arena);
+
+    // reserves region_bytes of address space for a compact heap, 4 GB when 0 and at most 32 GB. pages
+    // are committed when first touched. a compact heap is thread safe.
+    fc_compact_t *fc_compact_create(size_t region_bytes);
+
+    // unmaps the region, every object of the heap is gone.
+    void fc_compact_destroy(fc_compact_t *heap);
+
+    // objects up to 256 KB - 8 bytes. returns NULL when the region is used up or size is too large.
+    // compact objects must not be passed to free().
+    void *fc_compact_alloc(fc_compact_t *heap, size_t size);
+
+    void fc_compact_free(fc_compact_t *heap, void *p);
+
+    // the heap lives at the start of its region, so a handle is the offset from the heap. 0 is NULL.
+    static inline uint32_t fc_compact_encode(const fc_compact_t *heap, const void *p)
+    {
+        return p ? (uint32_t)(((const char *)p - (const char *)heap) >> FC_COMPACT_SHIFT) : 0;
+    }
+
+    static inline void *fc_compact_decode(const fc_compact_t *heap, uint32_t handle)
+    {
+        return handle ? (char *)heap + ((size_t)handle << FC_COMPACT_SHIFT) : NULL;
+    }
+#ifdef __cplusplus
+}
+#endif
+
+#endif
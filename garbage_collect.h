@@ -3,6 +3,7 @@
 
 #include "block_header.h"
 #include "block_list.h"
+#include "options.h"
 #include <atomic>
 
 class thread_allocator;
@@ -16,29 +17,224 @@ private:
     uint64_t _gc_pad1[7];                   // gc thread and this thread should not false-share these values
 
     block_header *_gc_on_deck; // where we save frees while waiting on gc to bat.
-    uint64_t _gc_pad2[7];      // gc thread and this thread should not false-share these values
+    uint64_t _on_deck_num;     // blocks in _gc_on_deck
+    uint64_t _inline_mark;     // on-deck length that triggers the next inline coalescing
+    uint64_t _gc_pad2[5];      // gc thread and this thread should not false-share these values
 
-    static inline block_list *as_block_list(block_header *h)
+    enum notify_enum
     {
-        return reinterpret_cast<block_list *>(h);
+        notify_queued = 1,  // already on the dirty queue, cleared by the gc thread
+        notify_retired = 2, // the owner thread exited, set together with queued
+    };
+
+    std::atomic<uint32_t> _notify; // notify_enum bits
+    garbage_collect *_dirty_next;  // link of the dirty queue
+    thread_allocator *_owner;      // allocator we belong to, lets the gc unregister it without a search
+
+    static std::atomic<garbage_collect *> _dirty_head; // threads that published garbage since the gc last looked
+
+    static inline block_list *as_block_list(block_header *&h)
+    {
+        return reinterpret_cast<block_list *>(&h);
+    }
+
+    // hand the on-deck list to the gc thread if it already took the last one.
+    void publish()
+    {
+        if (_gc_at_bat.load() == nullptr)
+        {
+            _gc_at_bat.store(_gc_on_deck);
+            _gc_on_deck = nullptr;
+            _on_deck_num = 0;
+            _inline_mark = 0;
+            notify();
+        }
+        else
+            coalesce_inline();
+    }
+
+    /**
+     * @brief 把自己挂到脏队列上，gc线程只访问队列中的线程
+     */
+    void notify(uint32_t bits = notify_queued)
+    {
+        if (_notify.fetch_or(notify_queued | bits) & notify_queued)
+            return; // the gc thread has not visited us since the last notify
+
+        garbage_collect *stale_head = _dirty_head.load(std::memory_order_relaxed);
+        do
+        {
+            _dirty_next = stale_head;
+        } while (!_dirty_head.compare_exchange_weak(stale_head, this, std::memory_order_release));
+    }
+
+    /**
+     * @brief gc线程迟迟不来取时，在本线程内合并on-deck中物理相邻的块，限制交接链表的长度
+     */
+    void coalesce_inline()
+    {
+        int64_t threshold = options::get(FC_OPT_INLINE_COALESCE);
+        if (threshold <= 0 || _on_deck_num < std::max((uint64_t)threshold, _inline_mark))
+            return;
+
+        _gc_on_deck = block_list::sort_by_address(_gc_on_deck);
+        _on_deck_num = block_list::coalesce_adjacent(_gc_on_deck);
+        _inline_mark = 2 * _on_deck_num; // little was adjacent, back off before sorting again
     }
 
 public:
-    void constructor(){
+    void constructor(thread_allocator *owner){
+        _owner=owner;
         _gc_at_bat=nullptr;
         memset(_gc_pad1,0,sizeof(_gc_pad1));
         _gc_on_deck=nullptr;
+        _on_deck_num=0;
+        _inline_mark=0;
+        _notify=0;
+        _dirty_next=nullptr;
         memset(_gc_pad2,0,sizeof(_gc_pad2));
     }
 
     void release(block_header *h)
     {
         as_block_list(_gc_on_deck)->push(h);
-        if (_gc_at_bat.load() == nullptr)
+        _on_deck_num++;
+        publish();
+    }
+
+    /**
+     * @brief 一次释放一批内存块，h为由queue_state串联并以nullptr结尾的链表
+     */
+    void release_batch(block_header *h)
+    {
+        if (!h)
+            return;
+
+        block_header *tail = h;
+        _on_deck_num++;
+        while (tail->as_queue_node().next)
         {
-            _gc_at_bat.store(_gc_on_deck);
-            _gc_on_deck = nullptr;
+            tail = tail->as_queue_node().next;
+            _on_deck_num++;
+        }
+
+        tail->as_queue_node().next = _gc_on_deck;
+        if (_gc_on_deck)
+            _gc_on_deck->as_queue_node().prev = tail;
+        h->as_queue_node().prev = nullptr;
+        _gc_on_deck = h;
+        publish();
+    }
+
+    /**
+     * @brief 从还没交给gc线程的on-deck中取走一个放得下size的大块，最多查看scan个。只由本线程调用
+     *
+     *  While the gc thread is still busy with the at-bat list our own frees pile up on deck, take one
+     *  back instead of mapping. Spans, long lived and medium blocks are left to the gc.
+     */
+    block_header *take_on_deck(size_t size, int scan)
+    {
+        block_header *prev = nullptr;
+        for (block_header *h = _gc_on_deck; h && scan > 0; prev = h, h = h->as_queue_node().next, scan--)
+        {
+            if (h->is_bigdata() || h->is_aligned() || h->is_longlived() || (size_t)h->size() < size || h->size() > LARGE_BLOCK)
+                continue;
+            block_header *nxt = h->as_queue_node().next;
+            if (prev)
+                prev->as_queue_node().next = nxt;
+            else
+                _gc_on_deck = nxt;
+            if (nxt)
+                nxt->as_queue_node().prev = prev;
+            _on_deck_num--;
+            return h;
         }
+        return nullptr;
+    }
+
+    /**
+     * @brief gc线程还没来取at-bat时收回到on-deck前部，本线程自己复用，返回是否收回了
+     */
+    bool take_back_at_bat()
+    {
+        if (_gc_at_bat.load(std::memory_order_relaxed) == nullptr)
+            return false;
+        block_header *h = _gc_at_bat.exchange(nullptr);
+        if (!h)
+            return false;
+
+        block_header *tail = h;
+        _on_deck_num++;
+        while (tail->as_queue_node().next)
+        {
+            tail = tail->as_queue_node().next;
+            _on_deck_num++;
+        }
+        tail->as_queue_node().next = _gc_on_deck;
+        if (_gc_on_deck)
+            _gc_on_deck->as_queue_node().prev = tail;
+        h->as_queue_node().prev = nullptr;
+        _gc_on_deck = h;
+        return true;
+    }
+
+    /**
+     * @brief 连同gc线程还没取走的at-bat一起交出on-deck，线程停下前调用，不必等到下一次释放
+     */
+    void hand_over()
+    {
+        take_back_at_bat();
+        if (_gc_on_deck)
+            publish();
+    }
+
+    /**
+     * @brief 线程退出时最后调用，之后本对象归gc线程所有
+     */
+    void retire()
+    {
+        notify(notify_retired);
+    }
+
+    /**
+     * @brief gc线程调用，一次取走整个脏队列，所以没有ABA问题
+     */
+    static garbage_collect *take_dirty()
+    {
+        return _dirty_head.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    garbage_collect *dirty_next()
+    {
+        return _dirty_next;
+    }
+
+    thread_allocator *owner()
+    {
+        return _owner;
+    }
+
+    /**
+     * @brief gc线程调用，先清除排队标记再取垃圾，之后发布的垃圾会让线程重新排队
+     *
+     *  retired is set on the last visit of an exited thread. Its on-deck list is taken as well, and
+     *  nothing references this object any more once the call returns.
+     */
+    block_header *take_notified_garbage(bool &retired)
+    {
+        retired = _notify.fetch_and(~(uint32_t)notify_queued) & notify_retired;
+        block_header *garbage = get_garbage();
+        if (!retired || !_gc_on_deck)
+            return garbage;
+
+        block_header *tail = _gc_on_deck;
+        while (tail->as_queue_node().next)
+            tail = tail->as_queue_node().next;
+        tail->as_queue_node().next = garbage;
+        garbage = _gc_on_deck;
+        _gc_on_deck = nullptr;
+        _on_deck_num = 0;
+        return garbage;
     }
 
     /** 
@@ -46,13 +242,12 @@ public:
     */
     block_header *get_garbage() // grab a pointer previously claimed.
     {
-        if (block_header *garbage = _gc_at_bat.load())
-        {
-            _gc_at_bat.store(nullptr);
-            return garbage;
-        }
-        return nullptr;
+        if (_gc_at_bat.load(std::memory_order_relaxed) == nullptr)
+            return nullptr;
+        return _gc_at_bat.exchange(nullptr); // the owner may take it back, see take_back_at_bat
     }
 };
 
-#endif
\ No newline at end of file
+inline std::atomic<garbage_collect *> garbage_collect::_dirty_head(nullptr);
+
+#endif
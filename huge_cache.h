@@ -0,0 +1,252 @@
+#ifndef HUGE_CACHE
+#define HUGE_CACHE
+
+#include <stddef.h>
+#include <mutex>
+#include "common.h"
+#include "block_header.h"
+#include "spin_lock.h"
+#include "os.h"
+
+/**
+ * @brief 巨大块头部，位于映射区首部。映射长度记录在这里，不受block_header中_size的限制
+ */
+struct huge_header
+{
+    size_t map_size;     // length of the whole mapping
+    size_t committed;    // bytes counted as mapped, the first page only once the body was given back to the system
+    huge_header *next;   // registry or cache link
+    huge_header *prev;
+    uint64_t _pad;       // keep user data 16 byte aligned
+    block_header header; // bigdata block in front of the user data, its _size is 0
+
+    char *data() { return header.data(); }
+
+    static huge_header *from_block(block_header *h)
+    {
+        return reinterpret_cast<huge_header *>(reinterpret_cast<char *>(h) - offsetof(huge_header, header));
+    }
+};
+
+/**
+ * @brief 巨大块的登记表和缓存。
+ *
+ *  Every live huge mapping is linked in the registry. Freed mappings are kept in a bounded cache, most
+ *  recently freed first, and reused by best fit. When the cache holds too many resident bytes the oldest
+ *  entries are decommitted, when it holds too much address space they are unmapped.
+ */
+class huge_cache
+{
+public:
+    huge_cache()
+        : _live(nullptr), _cached(nullptr), _live_bytes(0), _cached_num(0), _cached_bytes(0), _committed_bytes(0), _pinned_bytes(0) {}
+
+    /**
+     * @brief 分配巨大块，优先从缓存中最佳适配
+     */
+    char *alloc(size_t s, bool populate)
+    {
+        size_t need = round_up(s + sizeof(huge_header));
+        size_t trimmed = 0;
+        huge_header *hh;
+        {
+            std::lock_guard<spin_lock> guard(_lock);
+            hh = take_best_fit(need, trimmed);
+            if (hh)
+                link_live(hh);
+        }
+
+        if (hh)
+        {
+            // giving pages back can be slow, do it outside of the lock
+            if (trimmed)
+                os::decommit(reinterpret_cast<char *>(hh) + need, trimmed);
+            if (populate)
+                os::populate(hh, need);
+            return hh->data();
+        }
+
+        hh = reinterpret_cast<huge_header *>(os::mmap_alloc(need, populate));
+        hh->map_size = need;
+        hh->committed = need;
+        hh->header.init(HEDER_SIZE);
+        hh->header.set_state(block_header::bigdata);
+
+        std::lock_guard<spin_lock> guard(_lock);
+        link_live(hh);
+        return hh->data();
+    }
+
+    /**
+     * @brief 释放巨大块到缓存，超出界限的旧缓存被解除提交或解除映射
+     */
+    void release(huge_header *hh)
+    {
+        huge_header *evicted = nullptr;
+        {
+            std::lock_guard<spin_lock> guard(_lock);
+            unlink(_live, hh);
+            _live_bytes -= hh->map_size; // committed stays what alloc counted, assume the caller touched all of it
+
+            push_front(_cached, hh);
+            _cached_num++;
+            _cached_bytes += hh->map_size;
+            _committed_bytes += hh->committed;
+
+            evicted = evict(HUGE_CACHE_NUM, std::max((size_t)HUGE_CACHE_BYTES, _pinned_bytes));
+            decommit(std::max((size_t)HUGE_CACHE_COMMIT_BYTES, _pinned_bytes));
+        }
+
+        // unmapping can be slow, do it outside of the lock
+        while (evicted)
+        {
+            huge_header *nxt = evicted->next;
+            os::unreserve(evicted, evicted->map_size, evicted->committed);
+            evicted = nxt;
+        }
+    }
+
+    /**
+     * @brief 解除提交缓存中的物理页，直到驻留字节数不超过keep_bytes
+     */
+    void trim(size_t keep_bytes)
+    {
+        std::lock_guard<spin_lock> guard(_lock);
+        decommit(std::max(keep_bytes, _pinned_bytes));
+    }
+
+    /**
+     * @brief 预热后缓存中保持提交的字节数，只升不降，bytes为0时取消
+     */
+    void pin(size_t bytes)
+    {
+        std::lock_guard<spin_lock> guard(_lock);
+        _pinned_bytes = bytes ? std::max(_pinned_bytes, bytes) : 0;
+    }
+
+    /**
+     * @brief 巨大块实际映射的字节数
+     */
+    static size_t map_size(size_t s)
+    {
+        return round_up(s + sizeof(huge_header));
+    }
+
+    size_t get_live_bytes() const { return _live_bytes; }
+    size_t get_cached_bytes() const { return _cached_bytes; }
+
+private:
+    static size_t round_up(size_t s)
+    {
+        return (s + OS_PAGE_SIZE - 1) & ~(size_t)(OS_PAGE_SIZE - 1);
+    }
+
+    static void push_front(huge_header *&head, huge_header *hh)
+    {
+        hh->prev = nullptr;
+        hh->next = head;
+        if (head)
+            head->prev = hh;
+        head = hh;
+    }
+
+    static void unlink(huge_header *&head, huge_header *hh)
+    {
+        if (hh->prev)
+            hh->prev->next = hh->next;
+        else
+            head = hh->next;
+        if (hh->next)
+            hh->next->prev = hh->prev;
+    }
+
+    void link_live(huge_header *hh)
+    {
+        push_front(_live, hh);
+        _live_bytes += hh->map_size;
+    }
+
+    /**
+     * @brief 最佳适配，映射不超过所需的两倍。多余的已提交尾部长度放入trimmed由调用者解除提交，不够的部分计入
+     */
+    huge_header *take_best_fit(size_t need, size_t &trimmed)
+    {
+        huge_header *best = nullptr;
+        for (huge_header *hh = _cached; hh; hh = hh->next)
+        {
+            if (hh->map_size >= need && hh->map_size <= 2 * need && (!best || hh->map_size < best->map_size))
+                best = hh;
+        }
+        if (!best)
+            return nullptr;
+
+        unlink(_cached, best);
+        _cached_num--;
+        _cached_bytes -= best->map_size;
+        _committed_bytes -= best->committed;
+
+        if (best->committed > need)
+            trimmed = best->committed - need;
+        else
+            os::commit(need - best->committed);
+        best->committed = need;
+        return best;
+    }
+
+    /**
+     * @brief 从最旧的缓存开始解除提交，首页保留
+     */
+    void decommit(size_t keep_bytes)
+    {
+        huge_header *hh = tail(_cached);
+        while (hh && _committed_bytes > keep_bytes)
+        {
+            if (hh->committed > OS_PAGE_SIZE)
+            {
+                os::decommit(reinterpret_cast<char *>(hh) + OS_PAGE_SIZE, hh->committed - OS_PAGE_SIZE);
+                _committed_bytes -= hh->committed - OS_PAGE_SIZE;
+                hh->committed = OS_PAGE_SIZE;
+            }
+            hh = hh->prev;
+        }
+    }
+
+    /**
+     * @brief 从最旧的缓存开始摘除，返回需要解除映射的链表
+     */
+    huge_header *evict(size_t max_num, size_t max_bytes)
+    {
+        huge_header *evicted = nullptr;
+        huge_header *hh = tail(_cached);
+        while (hh && (_cached_num > max_num || _cached_bytes > max_bytes))
+        {
+            huge_header *prv = hh->prev;
+            unlink(_cached, hh);
+            _cached_num--;
+            _cached_bytes -= hh->map_size;
+            _committed_bytes -= hh->committed;
+            hh->next = evicted;
+            evicted = hh;
+            hh = prv;
+        }
+        return evicted;
+    }
+
+    static huge_header *tail(huge_header *head)
+    {
+        while (head && head->next)
+            head = head->next;
+        return head;
+    }
+
+    spin_lock _lock;
+    huge_header *_live;   // registry of huge blocks in use
+    huge_header *_cached; // freed mappings, most recent first
+    size_t _live_bytes;
+    size_t _cached_num;
+    size_t _cached_bytes;
+    size_t _committed_bytes; // resident bytes held by the cache
+    size_t _pinned_bytes;    // committed bytes release and trim keep, see fc_warmup
+};
+
+#endif
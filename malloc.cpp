@@ -1,4 +1,5 @@
 #include "thread.h"
+#include "fc_malloc.h"
 
 void *operator new(size_t s)
 {
@@ -7,7 +8,12 @@ void *operator new(size_t s)
 
 void operator delete(void *s)
 {
-    return thread_allocator::get()->free(reinterpret_cast<char *>(s));
+    return thread_allocator::thread_free(reinterpret_cast<char *>(s));
+}
+
+void operator delete(void *s, size_t)
+{
+    return thread_allocator::thread_free(reinterpret_cast<char *>(s));
 }
 
 char *gc_malloc(int s)
@@ -17,5 +23,189 @@ char *gc_malloc(int s)
 
 void gc_free(char *s)
 {
-    return thread_allocator::get()->free(s);
-}
\ No newline at end of file
+    return thread_allocator::thread_free(s);
+}
+
+void *fc_malloc_flags(size_t s, int flags)
+{
+    return thread_allocator::get()->alloc(s, flags);
+}
+
+int fc_malloc_set_option(int option, int64_t value)
+{
+    return options::set(option, value) ? 0 : -1;
+}
+
+size_t fc_malloc_bin_stats(fc_bin_stats *out, size_t n)
+{
+    return garbage_collector::get().get_bin_stats(out, n);
+}
+
+fc_heap_t *fc_heap_create()
+{
+    return reinterpret_cast<fc_heap_t *>(thread_allocator::create());
+}
+
+void fc_heap_destroy(fc_heap_t *heap)
+{
+    thread_allocator::release(reinterpret_cast<thread_allocator *>(heap));
+}
+
+void *fc_heap_alloc(fc_heap_t *heap, size_t s)
+{
+    return reinterpret_cast<thread_allocator *>(heap)->alloc(s);
+}
+
+void fc_heap_free(fc_heap_t *heap, void *p)
+{
+    if (p)
+        reinterpret_cast<thread_allocator *>(heap)->free(static_cast<char *>(p));
+}
+
+fc_arena_t *fc_arena_create(int flags)
+{
+    return reinterpret_cast<fc_arena_t *>(arena::create(flags & FC_ARENA_SIZE_CLASSES));
+}
+
+void *fc_arena_alloc(fc_arena_t *a, size_t s)
+{
+    return reinterpret_cast<arena *>(a)->alloc(s);
+}
+
+void fc_arena_free(fc_arena_t *a, void *p)
+{
+    if (p)
+        reinterpret_cast<arena *>(a)->free(static_cast<char *>(p));
+}
+
+void fc_arena_reset(fc_arena_t *a)
+{
+    garbage_collector::get().donate_same_bin(reinterpret_cast<arena *>(a)->reset());
+}
+
+void fc_arena_destroy(fc_arena_t *a)
+{
+    garbage_collector::get().donate_same_bin(reinterpret_cast<arena *>(a)->destroy());
+}
+
+fc_compact_t *fc_compact_create(size_t region_bytes)
+{
+    return reinterpret_cast<fc_compact_t *>(compact_heap::create(region_bytes));
+}
+
+void fc_compact_destroy(fc_compact_t *heap)
+{
+    reinterpret_cast<compact_heap *>(heap)->destroy();
+}
+
+void *fc_compact_alloc(fc_compact_t *heap, size_t s)
+{
+    return reinterpret_cast<compact_heap *>(heap)->alloc(s);
+}
+
+void fc_compact_free(fc_compact_t *heap, void *p)
+{
+    if (p)
+        reinterpret_cast<compact_heap *>(heap)->free(static_cast<char *>(p));
+}
+
+void fc_retire(void *p)
+{
+    if (p)
+        thread_allocator::get()->retire(static_cast<char *>(p));
+}
+
+void fc_quiescent()
+{
+    thread_allocator::get()->quiescent();
+}
+
+int fc_set_lifetime(int flags)
+{
+    return thread_allocator::get()->set_lifetime(flags);
+}
+
+void *fc_alloc_near(const void *hint, size_t s)
+{
+    return thread_allocator::get()->alloc_near(static_cast<const char *>(hint), s);
+}
+
+void fc_alloc_near_stats(fc_near_stats *out)
+{
+    garbage_collector::get().get_near_stats(*out);
+}
+
+int fc_set_tag(int tag)
+{
+    return thread_allocator::get()->set_tag(tag);
+}
+
+int fc_tag_get_stats(int tag, fc_tag_stats *out)
+{
+    if (tag < 0 || tag >= FC_MAX_TAGS)
+        return -1;
+    garbage_collector::get().get_tag_stats(tag, *out);
+    return 0;
+}
+
+int fc_tag_set_limit(int tag, int64_t bytes)
+{
+    if (tag < 0 || tag >= FC_MAX_TAGS)
+        return -1;
+    garbage_collector::get().set_tag_limit(tag, bytes);
+    return 0;
+}
+
+void fc_tag_set_limit_callback(fc_tag_limit_fn fn, void *arg)
+{
+    garbage_collector::get().set_tag_limit_callback(fn, arg);
+}
+
+void fc_set_heap_limit(int64_t bytes)
+{
+    garbage_collector::get(); // the gc reads the cgroup limit when it starts, do not let it overwrite ours
+    os::set_soft_limit(bytes);
+}
+
+int64_t fc_get_heap_limit()
+{
+    return os::get_soft_limit();
+}
+
+int64_t fc_set_heap_limit_from_cgroup(const char *path)
+{
+    garbage_collector::get();
+    return os::set_soft_limit_from_cgroup(path);
+}
+
+void fc_set_heap_limit_callback(fc_heap_limit_fn fn, void *arg)
+{
+    os::set_limit_callback(fn, arg);
+}
+
+int fc_should_move(const void *p)
+{
+    return p && thread_allocator::get()->should_move(static_cast<const char *>(p)) ? 1 : 0;
+}
+
+void *fc_alloc_for_move(size_t s)
+{
+    return thread_allocator::get()->alloc_for_move(s);
+}
+
+void fc_warmup(const fc_warmup_class *profile, size_t n, int flags)
+{
+    thread_allocator *ta = thread_allocator::get();
+    for (size_t i = 0; i < n; i++)
+    {
+        if (flags & FC_WARMUP_WATERMARK)
+            garbage_collector::get().set_watermark(profile[i].size, profile[i].count, ta->get_lifetime() & FC_LONG_LIVED);
+        if (profile[i].size)
+            ta->warmup(profile[i].size, profile[i].count);
+    }
+}
+
+void fc_thread_cache_flush()
+{
+    thread_allocator::get()->flush_caches();
+}
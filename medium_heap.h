@@ -0,0 +1,348 @@
+#ifndef MEDIUM_HEAP
+#define MEDIUM_HEAP
+
+#include <mutex>
+#include "common.h"
+#include "block_header.h"
+#include "spin_lock.h"
+#include "os.h"
+
+/**
+ * @brief 中等块区域，按页切分。区域按MEDIUM_REGION_SIZE对齐，首部存放每页的边界标记
+ *
+ *  The first and the last page of every run carry the tag (pages << 1) | free, so a freed run
+ *  finds its neighbours in O(1) and coalesces with them.
+ */
+struct medium_region
+{
+    medium_region *next;
+    size_t free_pages;
+    uint32_t tags[MEDIUM_REGION_PAGES];
+};
+
+#define MEDIUM_META_PAGES ((sizeof(medium_region) + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE)
+#define MEDIUM_NUM_LISTS 16 // free lists segregated by log2 of the run length
+
+/**
+ * @brief 空闲页段，存放在空闲段的首页中
+ */
+struct medium_free_run
+{
+    size_t pages;
+    size_t committed; // pages of the run counted by os::commit, 1 once the rest was given back to the system
+    medium_free_run *next;
+    medium_free_run *prev;
+};
+
+/**
+ * @brief 中等块分配器，服务 LARGE_BLOCK 到 MEDIUM_BLOCK 的分配
+ *
+ *  Runs of pages are carved out of large reserved regions by best fit. Threads allocate under a spin
+ *  lock, frees come back through the garbage collector which coalesces them and, when idle, gives
+ *  free pages and empty regions back to the system.
+ */
+class medium_heap
+{
+public:
+    medium_heap() : _regions(nullptr), _nonempty(0), _released(0), _pinned(0)
+    {
+        memset(_lists, 0, sizeof(_lists));
+    }
+
+    /**
+     * @brief 分配页段，返回数据区
+     */
+    char *alloc(size_t s, bool populate)
+    {
+        size_t pages = (s + HEDER_SIZE + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE;
+        char *p;
+        {
+            std::lock_guard<spin_lock> guard(_lock);
+            p = take_run(pages);
+        }
+
+        if (!p)
+        {
+            // reserving a region maps and unmaps, do it outside of the lock
+            medium_region *r = new_region();
+            bool added = false;
+            {
+                std::lock_guard<spin_lock> guard(_lock);
+                p = take_run(pages);
+                if (!p)
+                {
+                    add_region(r);
+                    added = true;
+                    p = take_run(pages);
+                }
+            }
+            if (!added) // another thread added a region meanwhile
+                os::unreserve(r, MEDIUM_REGION_SIZE, MEDIUM_META_PAGES * OS_PAGE_SIZE);
+        }
+
+        if (populate)
+            os::populate(p, pages * OS_PAGE_SIZE);
+
+        block_header *h = reinterpret_cast<block_header *>(p);
+        h->init(pages * OS_PAGE_SIZE);
+        h->set_state(block_header::bigdata);
+        return h->data();
+    }
+
+    /**
+     * @brief 回收页段并与相邻空闲段合并，由垃圾回收线程调用
+     */
+    void release(block_header *h)
+    {
+        char *p = reinterpret_cast<char *>(h);
+        medium_region *r = region_of(p);
+        size_t first = page_of(r, p);
+        size_t pages = run_pages(r->tags[first]);
+
+        std::lock_guard<spin_lock> guard(_lock);
+        size_t committed = pages;
+        r->free_pages += pages;
+
+        // coalesce with the run on the left
+        if (first > MEDIUM_META_PAGES && is_free(r->tags[first - 1]))
+        {
+            size_t left_pages = run_pages(r->tags[first - 1]);
+            medium_free_run *left = as_run(r, first - left_pages);
+            committed += left->committed;
+            unlink(left);
+            first -= left_pages;
+            pages += left_pages;
+        }
+
+        // coalesce with the run on the right
+        size_t right = first + pages;
+        if (right < MEDIUM_REGION_PAGES && is_free(r->tags[right]))
+        {
+            medium_free_run *run = as_run(r, right);
+            committed += run->committed;
+            unlink(run);
+            pages += run->pages;
+        }
+
+        medium_free_run *run = as_run(r, first);
+        run->committed = committed;
+        insert(r, first, pages);
+        _released++;
+    }
+
+    /**
+     * @brief 预热后保持提交的空闲页数，只升不降，pages为0时取消
+     */
+    void pin(size_t pages)
+    {
+        std::lock_guard<spin_lock> guard(_lock);
+        _pinned = pages ? std::max(_pinned, pages) : 0;
+    }
+
+    /**
+     * @brief 空闲时解除提交大的空闲段，并解除映射多余的空区域，保留预热钉住的页数
+     */
+    void trim()
+    {
+        if (_released == 0)
+            return;
+
+        medium_region *empty = nullptr;
+        {
+            std::lock_guard<spin_lock> guard(_lock);
+            _released = 0;
+
+            size_t committed = 0; // committed free pages, decommitting stops at _pinned
+            for (int i = 0; i < MEDIUM_NUM_LISTS; i++)
+                for (medium_free_run *run = _lists[i]; run; run = run->next)
+                    committed += run->committed;
+
+            for (int i = 0; i < MEDIUM_NUM_LISTS && committed > _pinned; i++)
+            {
+                for (medium_free_run *run = _lists[i]; run && committed > _pinned; run = run->next)
+                {
+                    if (run->committed > 1 && run->pages > MEDIUM_DECOMMIT_PAGES)
+                    {
+                        // the first page holds the free run, keep it
+                        os::decommit(reinterpret_cast<char *>(run) + OS_PAGE_SIZE, (run->pages - 1) * OS_PAGE_SIZE, (run->committed - 1) * OS_PAGE_SIZE);
+                        committed -= run->committed - 1;
+                        run->committed = 1;
+                    }
+                }
+            }
+
+            // keep one empty region around to absorb the next burst
+            bool spare = false;
+            medium_region **link = &_regions;
+            while (*link)
+            {
+                medium_region *r = *link;
+                if (r->free_pages == MEDIUM_REGION_PAGES - MEDIUM_META_PAGES)
+                {
+                    size_t pages = as_run(r, MEDIUM_META_PAGES)->committed;
+                    if (spare && committed - pages >= _pinned)
+                    {
+                        committed -= pages;
+                        unlink(as_run(r, MEDIUM_META_PAGES));
+                        *link = r->next;
+                        r->next = empty;
+                        empty = r;
+                        continue;
+                    }
+                    spare = true;
+                }
+                link = &r->next;
+            }
+        }
+
+        while (empty)
+        {
+            medium_region *nxt = empty->next;
+            os::unreserve(empty, MEDIUM_REGION_SIZE, (MEDIUM_META_PAGES + as_run(empty, MEDIUM_META_PAGES)->committed) * OS_PAGE_SIZE);
+            empty = nxt;
+        }
+    }
+
+private:
+    static medium_region *region_of(char *p)
+    {
+        return reinterpret_cast<medium_region *>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(MEDIUM_REGION_SIZE - 1));
+    }
+
+    static size_t page_of(medium_region *r, char *p)
+    {
+        return (p - reinterpret_cast<char *>(r)) / OS_PAGE_SIZE;
+    }
+
+    static medium_free_run *as_run(medium_region *r, size_t page)
+    {
+        return reinterpret_cast<medium_free_run *>(reinterpret_cast<char *>(r) + page * OS_PAGE_SIZE);
+    }
+
+    static size_t run_pages(uint32_t tag) { return tag >> 1; }
+    static bool is_free(uint32_t tag) { return tag & 1; }
+
+    static void set_tags(medium_region *r, size_t first, size_t pages, bool free)
+    {
+        uint32_t tag = (pages << 1) | (free ? 1 : 0);
+        r->tags[first] = tag;
+        r->tags[first + pages - 1] = tag;
+    }
+
+    static int list_of(size_t pages)
+    {
+        int l = 63 - __builtin_clzll(pages);
+        return l < MEDIUM_NUM_LISTS ? l : MEDIUM_NUM_LISTS - 1;
+    }
+
+    /**
+     * @brief 预留一个新区域，按区域大小对齐。只计入首部，页段在分配时计入
+     */
+    static medium_region *new_region()
+    {
+        char *raw = os::reserve(2 * MEDIUM_REGION_SIZE);
+        char *aligned = reinterpret_cast<char *>(
+            (reinterpret_cast<uintptr_t>(raw) + MEDIUM_REGION_SIZE - 1) & ~(uintptr_t)(MEDIUM_REGION_SIZE - 1));
+        if (aligned > raw)
+            os::unreserve(raw, aligned - raw);
+        if (aligned + MEDIUM_REGION_SIZE < raw + 2 * MEDIUM_REGION_SIZE)
+            os::unreserve(aligned + MEDIUM_REGION_SIZE, raw + 2 * MEDIUM_REGION_SIZE - aligned - MEDIUM_REGION_SIZE);
+        os::commit(MEDIUM_META_PAGES * OS_PAGE_SIZE);
+
+        medium_region *r = reinterpret_cast<medium_region *>(aligned);
+        r->next = nullptr;
+        r->free_pages = 0;
+        return r;
+    }
+
+    void add_region(medium_region *r)
+    {
+        r->next = _regions;
+        _regions = r;
+
+        size_t pages = MEDIUM_REGION_PAGES - MEDIUM_META_PAGES;
+        r->free_pages = pages;
+        as_run(r, MEDIUM_META_PAGES)->committed = 0;
+        insert(r, MEDIUM_META_PAGES, pages);
+    }
+
+    void insert(medium_region *r, size_t first, size_t pages)
+    {
+        set_tags(r, first, pages, true);
+
+        medium_free_run *run = as_run(r, first);
+        int l = list_of(pages);
+        run->pages = pages;
+        run->prev = nullptr;
+        run->next = _lists[l];
+        if (_lists[l])
+            _lists[l]->prev = run;
+        _lists[l] = run;
+        _nonempty |= 1u << l;
+    }
+
+    void unlink(medium_free_run *run)
+    {
+        int l = list_of(run->pages);
+        if (run->prev)
+            run->prev->next = run->next;
+        else
+            _lists[l] = run->next;
+        if (run->next)
+            run->next->prev = run->prev;
+        if (!_lists[l])
+            _nonempty &= ~(1u << l);
+    }
+
+    /**
+     * @brief 最佳适配：在本级链表中找最小的可用段，否则取更高一级的第一个段
+     */
+    char *take_run(size_t pages)
+    {
+        medium_free_run *best = nullptr;
+        int l = list_of(pages);
+
+        int scanned = 0;
+        for (medium_free_run *run = _lists[l]; run && scanned < MEDIUM_FIT_SCAN; run = run->next, scanned++)
+        {
+            if (run->pages >= pages && (!best || run->pages < best->pages))
+                best = run;
+        }
+
+        if (!best)
+        {
+            uint32_t higher = _nonempty & ~((2u << l) - 1);
+            if (!higher)
+                return nullptr;
+            best = _lists[__builtin_ctz(higher)];
+        }
+
+        char *p = reinterpret_cast<char *>(best);
+        medium_region *r = region_of(p);
+        size_t first = page_of(r, p);
+        size_t run = best->pages;
+        size_t committed = best->committed;
+        unlink(best);
+
+        //页段的已计入页先算给分配出去的部分，其余页在使用时提交
+        size_t counted = std::min(committed, pages);
+        os::commit((pages - counted) * OS_PAGE_SIZE);
+        if (run > pages)
+        {
+            as_run(r, first + pages)->committed = committed - counted;
+            insert(r, first + pages, run - pages);
+        }
+        set_tags(r, first, pages, false);
+        r->free_pages -= pages;
+        return p;
+    }
+
+    spin_lock _lock;
+    medium_region *_regions;
+    medium_free_run *_lists[MEDIUM_NUM_LISTS];
+    uint32_t _nonempty; // bit l is set when _lists[l] is not empty
+    uint64_t _released; // runs freed since the last trim
+    size_t _pinned;     // committed free pages trim keeps, see fc_warmup
+};
+
+#endif
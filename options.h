@@ -0,0 +1,42 @@
+#ifndef OPTIONS
+#define OPTIONS
+
+#include <stdint.h>
+#include "common.h"
+#include "fc_malloc.h"
+
+/**
+ * @brief 运行时可调参数，由fc_malloc_set_option设置，读取不做同步
+ */
+class options
+{
+public:
+    static int64_t get(int opt)
+    {
+        return _values[opt];
+    }
+
+    static bool set(int opt, int64_t value)
+    {
+        if (opt < 0 || opt >= FC_OPT_NUM)
+            return false;
+        _values[opt] = value;
+        return true;
+    }
+
+private:
+    static int64_t _values[FC_OPT_NUM];
+};
+
+inline int64_t options::_values[FC_OPT_NUM] = {
+    REFILL_SPINS,      // FC_OPT_REFILL_SPINS
+    REFILL_WAIT_US,    // FC_OPT_REFILL_WAIT_US
+    GC_WORK_BUDGET,    // FC_OPT_GC_WORK_BUDGET
+    GC_TIME_BUDGET_US, // FC_OPT_GC_TIME_BUDGET_US
+    INLINE_COALESCE,   // FC_OPT_INLINE_COALESCE
+    DEFERRED_COALESCE, // FC_OPT_DEFERRED_COALESCE
+    THREAD_IDLE_MS,    // FC_OPT_THREAD_IDLE_MS
+    STEAL_VICTIMS,     // FC_OPT_STEAL_VICTIMS
+};
+
+#endif
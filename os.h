@@ -2,7 +2,12 @@
 #define OS
 
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include "common.h"
 #include "block_header.h"
+#include "fc_malloc.h"
 
 class os
 {
@@ -16,19 +21,169 @@ public:
         return bl;
     }
 
-    static char *mmap_alloc(size_t s)
+    static char *mmap_alloc(size_t s, bool populate = false)
     {
-        void *limit = ::mmap(0, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        int64_t soft = _soft_limit.load(std::memory_order_relaxed);
+        if (soft > 0 && mapped_bytes() + (int64_t)s > soft)
+            over_limit(s, soft);
 
-        if (!limit)
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (populate)
+            flags |= MAP_POPULATE;
+        void *limit = ::mmap(0, s, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+        if (limit == MAP_FAILED)
             throw std::bad_alloc();
+        _mapped_bytes.fetch_add(s, std::memory_order_relaxed);
         return static_cast<char *>(limit);
     }
 
     static void mmap_free(void *pos, size_t s)
     {
         ::munmap(pos, s);
+        _mapped_bytes.fetch_sub(s, std::memory_order_relaxed);
+    }
+
+    // reserve address space, its pages are committed when first touched. not counted as mapped, the
+    // owner counts the pages it hands out with commit.
+    static char *reserve(size_t s)
+    {
+        void *limit = ::mmap(0, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (limit == MAP_FAILED)
+            throw std::bad_alloc();
+        return static_cast<char *>(limit);
+    }
+
+    // committed is the part of the range still counted as mapped.
+    static void unreserve(void *pos, size_t s, size_t committed = 0)
+    {
+        ::munmap(pos, s);
+        _mapped_bytes.fetch_sub(committed, std::memory_order_relaxed);
+    }
+
+    // count pages of a reserved or decommitted range that are about to be touched.
+    static void commit(size_t s)
+    {
+        _mapped_bytes.fetch_add(s, std::memory_order_relaxed);
+    }
+
+    // give the physical pages back but keep the address range reserved. committed is the part of the
+    // range counted as mapped, the rest was never touched or was decommitted before.
+    static void decommit(void *pos, size_t s, size_t committed)
+    {
+        ::madvise(pos, s, MADV_DONTNEED);
+        _mapped_bytes.fetch_sub(committed, std::memory_order_relaxed);
+    }
+
+    static void decommit(void *pos, size_t s)
+    {
+        decommit(pos, s, s);
+    }
+
+    // fault in the pages of an already mapped range.
+    static void populate(void *pos, size_t s)
+    {
+#ifdef MADV_POPULATE_WRITE
+        if (::madvise(pos, s, MADV_POPULATE_WRITE) == 0)
+            return;
+#endif
+        for (size_t i = 0; i < s; i += OS_PAGE_SIZE)
+            static_cast<volatile char *>(pos)[i] = 0;
+    }
+
+    // bytes currently committed: mappings and the counted pages of reservations, less what was decommitted.
+    // an estimate, pressure and the soft limit are checked against it.
+    static int64_t mapped_bytes()
+    {
+        return _mapped_bytes.load(std::memory_order_relaxed);
     }
+
+    // 0 below HEAP_PRESSURE_PCT of the soft limit or without a limit, 1 up to the limit, 2 above it.
+    static int pressure()
+    {
+        int64_t limit = _soft_limit.load(std::memory_order_relaxed);
+        if (limit <= 0)
+            return 0;
+        int64_t mapped = mapped_bytes();
+        if (mapped >= limit)
+            return 2;
+        return mapped >= limit / 100 * HEAP_PRESSURE_PCT ? 1 : 0;
+    }
+
+    static void set_soft_limit(int64_t bytes)
+    {
+        _soft_limit.store(bytes > 0 ? bytes : 0, std::memory_order_relaxed);
+    }
+
+    static int64_t get_soft_limit()
+    {
+        return _soft_limit.load(std::memory_order_relaxed);
+    }
+
+    static void set_limit_callback(fc_heap_limit_fn fn, void *arg)
+    {
+        _limit_arg.store(arg, std::memory_order_relaxed);
+        _limit_fn.store(fn, std::memory_order_release);
+    }
+
+    // sets the soft limit to HEAP_SOFT_LIMIT_PCT of the cgroup memory limit read from path, or from the
+    // cgroup v2 and then the v1 file when path is null. returns the soft limit, 0 when there is none.
+    static int64_t set_soft_limit_from_cgroup(const char *path)
+    {
+        int64_t limit = read_cgroup_limit(path ? path : CGROUP_V2_PATH);
+        if (!path && limit < 0)
+            limit = read_cgroup_limit(CGROUP_V1_PATH);
+        set_soft_limit(limit > 0 ? limit / 100 * HEAP_SOFT_LIMIT_PCT : 0);
+        return get_soft_limit();
+    }
+
+private:
+    // reads a cgroup limit with plain system calls, the allocator may not be usable yet.
+    // returns -1 when the file can not be read, 0 for no limit.
+    static int64_t read_cgroup_limit(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        char buf[32];
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        ::close(fd);
+        if (n <= 0)
+            return -1;
+
+        int64_t limit = 0;
+        for (ssize_t i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+        {
+            limit = limit * 10 + (buf[i] - '0');
+            if (limit >= CGROUP_UNLIMITED)
+                return 0;
+        }
+        return limit; // "max" parses as 0
+    }
+
+    // runs the limit callback before the heap grows past the soft limit, not for the mappings the
+    // callback itself causes.
+    static void over_limit(size_t s, int64_t limit)
+    {
+        fc_heap_limit_fn fn = _limit_fn.load(std::memory_order_acquire);
+        if (!fn || _in_limit_fn)
+            return;
+        _in_limit_fn = true;
+        fn(mapped_bytes(), s, limit, _limit_arg.load(std::memory_order_relaxed));
+        _in_limit_fn = false;
+    }
+
+    static std::atomic<int64_t> _mapped_bytes;
+    static std::atomic<int64_t> _soft_limit; // bytes, 0 for none
+    static std::atomic<fc_heap_limit_fn> _limit_fn;
+    static std::atomic<void *> _limit_arg;
+    static __thread bool _in_limit_fn;
 };
 
-#endif
\ No newline at end of file
+inline std::atomic<int64_t> os::_mapped_bytes(0);
+inline std::atomic<int64_t> os::_soft_limit(0);
+inline std::atomic<fc_heap_limit_fn> os::_limit_fn(nullptr);
+inline std::atomic<void *> os::_limit_arg(nullptr);
+inline __thread bool os::_in_limit_fn = false;
+
+#endif
@@ -2,6 +2,7 @@
 #define PAGE_MAP
 
 #include <stdint.h>
+#include <atomic>
 #include "bit_index.h"
 #include "common.h"
 #include "bin_allocator.h"
@@ -9,8 +10,7 @@
 //BITS
 #define POINTER_BITS_64 (48)
 #define KLEAF_BITS (15)
-#define SMALL_BIN_BITS (10)
-#define BITS (POINTER_BITS_64 - SMALL_BIN_BITS - KLEAF_BITS)
+#define BITS (POINTER_BITS_64 - SMALL_BIN_BITS) // span numbers, one span per SMALL_BIN_CAPCITY bytes
 #define KROOT_BITS (BITS - KLEAF_BITS)
 
 //LENGTH
@@ -20,7 +20,7 @@
 //SIZE
 #define LEAF_SIZE (sizeof(bin_info) * KLEAF_LENGTH)
 #define LEAF_ALLOC_NUM 20
-#define META_CHUNK_SIZE (LEAF_SIZE * LEAF_ALLOC_NUM)
+#define META_CHUNK_SIZE ((LEAF_SIZE + HEDER_SIZE) * LEAF_ALLOC_NUM) // every leaf carries a block header
 
 class block_header;
 class garbage_collector;
@@ -33,18 +33,26 @@ class bin_info
     friend class thread_allocator;
 
 public:
-    bin_info(uint8_t sz) : size(sz) {}
+    bin_info(uint32_t sz) : size(sz), tag(0), owner(nullptr) {}
+
+    /**
+     * @brief 单元块能放下的对象数，受位图宽度限制
+     */
+    uint64_t capacity() const
+    {
+        return std::min((uint64_t)(SMALL_BIN_SIZE / size), (uint64_t)64);
+    }
 
     /**
      * @brief 使用位图偏移来分配内存块,h为aligned_block首地址
      */
     char *alloc(block_header *h, int &flag_full)
     {
-        uint64_t pos = bindex.first_set_bit();
+        uint64_t pos = bit_index(~bindex.bits()).first_set_bit(); // first free slot
         bindex.set(pos);
 
         flag_full = 0;
-        if (bindex.count() == SMALL_BIN_SIZE / size)
+        if (bindex.count() == capacity())
         {
             flag_full = 1;
         }
@@ -67,7 +75,9 @@ public:
 
 private:
     uint32_t size;
+    uint8_t tag; // tag of the thread that took the span, fits in the padding
     bit_index bindex;
+    std::atomic<thread_allocator *> owner; // thread holding the span in a cache or partial slot, null when orphaned
 };
 
 class pagemap
@@ -83,17 +93,18 @@ private:
 public:
     typedef uintptr_t Number;
 
-    pagemap() : root{} {}
+    pagemap() {} // lives in the static gc object, root is zero already and touching it all would commit it
 
+    // returns an entry with size 0 when n is not a span, callers must not write to it
     bin_info &get(Number n)
     {
+        static bin_info unmapped(0);
         const Number i1 = n >> KLEAF_BITS;
-        bin_info b(0);
         if (root[i1] == nullptr)
-            return b;
+            return unmapped;
         const Number i2 = n & (KLEAF_LENGTH - 1);
         if (root[i1]->binfo[i2].size == 0)
-            return b;
+            return unmapped;
         return root[i1]->binfo[i2];
     }
 
@@ -104,13 +115,6 @@ public:
         return root[i1]->binfo[i2];
     }
 
-    void set(Number n, bin_info &b)
-    {
-        const Number i1 = n >> KLEAF_BITS;
-        const Number i2 = n & (KLEAF_LENGTH - 1);
-        root[i1]->binfo[i2] = b;
-    }
-    
     bool is_init(Number n){
         const Number i1 = n >> KLEAF_BITS;
         if(root[i1]==nullptr)
@@ -125,7 +129,7 @@ public:
 
         // Make 2nd level node if necessary
         Leaf *leaf = reinterpret_cast<Leaf *>(h);
-        memset(leaf, 0, sizeof(*leaf));
+        memset(static_cast<void *>(leaf), 0, sizeof(*leaf));
         root[i1] = leaf;
     }
 };
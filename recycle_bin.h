@@ -5,6 +5,11 @@
 #include "block_header.h"
 #include "block_list.h"
 #include "ring_buffer.h"
+#include "spin_lock.h"
+#include "options.h"
+#include "fc_malloc.h"
+#include <chrono>
+#include <mutex>
 
 /**
  * @brief 全局缓存，由ringbuffer和二级缓存组成
@@ -13,11 +18,30 @@ class recycle_bin
 {
 public:
     recycle_bin()
-        : _read_pos(0), _full(0), _write_pos(0)
+        : _read_pos(0), _misses(0), _write_pos(0), _full(0), _last_read_pos(0), _last_misses(0), _shrink_passes(0), _idle_passes(0), _demand(0),
+          _floor(0), _batch_num(1), _batch_bytes(0), _cached_bits(nullptr), _cached_mask(0), _cached_set(false)
     {
         memset(&_free_queue, 0, sizeof(_free_queue));
     }
 
+    /**
+     * @brief 设置每个ring_buffer槽位中一批内存块的数量和字节数上限，第一块总是放入
+     */
+    void set_batch(int64_t num, int64_t bytes)
+    {
+        _batch_num = num;
+        _batch_bytes = bytes;
+    }
+
+    /**
+     * @brief 登记缓存非空位图和本bin的位，缓存变空或变非空时在_list_lock下更新
+     */
+    void track_cached(std::atomic<uint64_t> *bits, uint64_t mask)
+    {
+        _cached_bits = bits;
+        _cached_mask = mask;
+    }
+
     // block can be used by thread
     // read the _read_pos without any atomic sync, we only care about an estimate
     int64_t available()
@@ -40,65 +64,225 @@ public:
     {
         _free_queue.at(claim_pos) = nullptr;
     }
+
+    /**
+     * @brief 没有发布的批、线程不来claim时记下一次需求，否则空的bin永远没有等级
+     */
+    void note_miss()
+    {
+        _misses.fetch_add(1, std::memory_order_relaxed);
+    }
     //////////////////////////////////////////////////////////////////////////////
 
     /**
-       * determines how many chunks should be required to consider this bin full. 
-       * we prefer to store appropriate blocks in the queue.
-       * 
-       * @return blocks nums the gc should publish, QUEUE_SIZE-1 max
-       */
+     * @brief 需求预测：用每轮gc的claim次数加上错过次数的EWMA决定ring_buffer中保持的批数
+     *
+     *  The level grows as soon as the forecast exceeds it, and only shrinks after the forecast stayed
+     *  well below it for RING_SHRINK_PASSES passes, so a bin does not flap between two levels.
+     *
+     * @return batches the gc should publish now, QUEUE_SIZE-1 max
+     */
     int64_t check_status()
     {
-        int64_t av = available();
+        int64_t read_pos = *((int64_t *)&_read_pos);
+        int64_t claims = read_pos - _last_read_pos; // failed claims count too, they are unmet demand
+        _last_read_pos = read_pos;
+        int64_t misses = _misses.load(std::memory_order_relaxed);
+        claims += misses - _last_misses; // so do threads that skipped the bin because nothing was published
+        _last_misses = misses;
+        _idle_passes = claims > 0 ? 0 : _idle_passes + 1;
+        _demand += (claims - _demand) * RING_EWMA_ALPHA;
+
+        int64_t target = (int64_t)(_demand * RING_HEADROOM + 0.999);
+        target = std::min(std::max(target, (int64_t)RING_MIN_LEVEL), (int64_t)QUEUE_SIZE - 1); // insure do not write cover
+        int pressure = _pressure.load(std::memory_order_relaxed);
+        target >>= pressure; // keep fewer batches published close to the heap limit
+        target = std::max(target, _floor.load(std::memory_order_relaxed));
 
-        if (av < 0) // imply potential demand
+        if (target > _full)
         {
-            if (_full == 0)
-                _full = 2; // fast increase to expect demand
-            else
-                _full *= 2;
-            _full = std::max(av, _full);
-            _full = std::max(_full, (int64_t)QUEUE_SIZE - 1); // insure do not write cover
-            _write_pos = claim(1);                            // reset
-            return _full;
+            _full = target;
+            _shrink_passes = 0;
         }
-        else if (av > 0)
+        else if (target < _full - (_full >> 2))
         {
-            int consumed = _full - av;
-            _full--; // slow back off, may be we didn't have enough to produce
-            if (_full < 0)
-                _full = 0;
-            return consumed == 0 ? -1 : consumed;
+            if (++_shrink_passes >= RING_SHRINK_PASSES || pressure)
+            {
+                _full = target;
+                _shrink_passes = 0;
+            }
         }
-        else if (av == 0) // _full is just right, keep it
+        else
+            _shrink_passes = 0;
+
+        int64_t av = _write_pos - read_pos;
+        if (av < 0) // consumers claimed past the last entry, skip the slots they burned
         {
-            return _full;
+            _write_pos = read_pos;
+            av = 0;
         }
-        return 0;
+        return _full - av;
     }
 
-    void clear_cached_block(block_header *h)
+    /**
+     * @brief 提高水位下限，等级不会低于它，只升不降
+     */
+    void raise_floor(int64_t batches)
+    {
+        batches = std::min(batches, (int64_t)QUEUE_SIZE - 1);
+        int64_t cur = _floor.load(std::memory_order_relaxed);
+        while (cur < batches && !_floor.compare_exchange_weak(cur, batches, std::memory_order_relaxed))
+            ;
+    }
+
+    /**
+     * @brief 取消水位下限，等级重新只由需求预测决定
+     */
+    void clear_floor()
+    {
+        _floor.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 发布的批数低于水位下限且缓存已空，需要gc线程映射新大块补充
+     */
+    bool needs_prefill()
     {
+        int64_t floor = _floor.load(std::memory_order_relaxed);
+        return floor > 0 && available() < floor && _free_list.empty();
+    }
+
+    /**
+     * @brief 近期有线程从这个bin取块，它的块不值得合并
+     */
+    bool has_demand() const
+    {
+        return _full > 0;
+    }
+
+    /**
+     * @brief 统计信息，读取不做同步
+     */
+    void get_stats(fc_bin_stats &st)
+    {
+        st.level = _full;
+        st.available = available();
+        st.demand = _demand;
+    }
+
+    /**
+     * @brief 合并前从缓存中摘除相邻块，已被本地线程取走或不再是size大小时返回false
+     *
+     *  The mergable bit is cleared under the lock, so the gc and a thread calling fc_alloc_near never
+     *  both take the same block. A cached block keeps its size until it is taken, so a block still of the
+     *  size the bin was chosen by is in this bin and not in the one the gc may have moved it to.
+     *
+     *  A block found through next->prev() by another thread than the gc may be gone already, the gc or
+     *  a split can rewrite next's _prev_size at any time. It is only looked at after next->prev() still
+     *  leads to it under the lock; a cached block can not change while we hold it.
+     */
+    bool take_cached_block(block_header *h, int size, block_header *next = nullptr)
+    {
+        std::lock_guard<spin_lock> guard(_list_lock);
+        if (next && next->prev() != h)
+            return false;
+        if (!h->is_mergable() || h->size() != size)
+            return false;
         _free_list.remove(h);
+        h->unset_state(block_header::mergable);
+        update_cached_bit();
+        return true;
     }
 
+    /**
+     * @brief 放入缓存并设置可合并状态
+     */
     void cache_block(block_header *h)
     {
+        std::lock_guard<spin_lock> guard(_list_lock);
+        h->set_state(block_header::mergable);
         _free_list.push(h);
+        update_cached_bit();
     }
 
     /**
-     * @brief 从缓存中提取内存块，取消可合并状态
+     * @brief 把一批内存块放回缓存，恢复可合并状态
      */
-    block_header *get_cache_block()
+    void cache_batch(block_header *h)
     {
-        block_header *h = _free_list.pop();
-        //Since the gc thread is single, the operation is safe. Done by others
-        h->unset_state(block_header::mergable);
+        std::lock_guard<spin_lock> guard(_list_lock);
+        return_batch(h);
+        update_cached_bit();
+    }
+
+    ////////////////////////////////慢速路径，被本地线程调用///////////////////////////////////
+    /**
+     * @brief ring_buffer中取一批，没有时返回nullptr
+     */
+    block_header *take_batch()
+    {
+        // this is our one and only atomic 'sync' operation...
+        int64_t claim_pos = claim(1);
+
+        // it will be thread safe, not two threads will access the same queue
+        if (claim_pos <= _write_pos)
+        {
+            block_header *h = get_block(claim_pos);
+            if (h)
+            {
+                clear_block(claim_pos); // let gc know we took it.
+                return h;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief ring_buffer为空时直接从gc的缓存中取一批，锁被gc线程持有时最多尝试spins次
+     */
+    block_header *pull_cached_batch(int64_t spins)
+    {
+        // the list is only looked at under the lock, the gc thread may be pushing right now
+        for (int64_t i = 0; !_list_lock.try_lock(); i++)
+        {
+            if (i >= spins)
+                return nullptr;
+        }
+        block_header *h = get_cache_batch();
+        update_cached_bit();
+        _list_lock.unlock();
         return h;
     }
 
+    /**
+     * @brief 登记饥饿状态，让gc线程不再休眠，最多等待wait_us微秒
+     */
+    block_header *wait_for_batch(int64_t wait_us)
+    {
+        if (wait_us <= 0)
+            return nullptr;
+
+        _starving.fetch_add(1);
+        block_header *h = nullptr;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(wait_us);
+        while (!h && std::chrono::steady_clock::now() < deadline)
+        {
+            if (available() > 0)
+                h = take_batch();
+            else
+                sched_yield();
+        }
+        _starving.fetch_sub(1);
+        return h;
+    }
+
+    // threads waiting for some bin to be refilled, the gc thread does not sleep while it is set
+    static int starving() { return _starving.load(std::memory_order_relaxed); }
+
+    // heap pressure level of os::pressure, set by the gc thread once per pass
+    static void set_pressure(int p) { _pressure.store(p, std::memory_order_relaxed); }
+    //////////////////////////////////////////////////////////////////////////////
+
     /**
      * @brief 向ring_buffer中生产块
      */
@@ -108,70 +292,175 @@ public:
         int64_t needed = check_status(); // returns the number of chunks need
         if (needed > 0)
         {
-            _full_count = 0;
-
+            std::lock_guard<spin_lock> guard(_list_lock);
             int64_t next_write_pos = _write_pos;
-            block_header *next = get_cache_block();
+            block_header *next = get_cache_batch();
 
             while (next && needed > 0)
             {
-                //poping block from bin and pushing into queue
+                //poping a batch from bin and pushing it into one slot
                 found_work = true;
                 ++next_write_pos;
                 // skip left things，if the queue was full, it will keep skiping
                 if (!_free_queue.at(next_write_pos))
                 {
                     _free_queue.at(next_write_pos) = next;
-                    next = get_cache_block();
+                    next = get_cache_batch();
                 }
                 --needed;
             }
 
             if (next)
-                cache_block(next); // leftover
+                return_batch(next); // leftover
+            update_cached_bit();
 
             _write_pos = next_write_pos;
         }
-        else
-            _full_count++;
 
         return found_work;
     }
 
+    /**
+     * @brief 连续IDLE_UNMAP_PASSES轮没有需求时取走整个缓存，交给gc线程合并并解除映射整个大块
+     *
+     *  Independent of the heap limit, so a bin nobody asks for does not keep its chunks mapped for
+     *  good. Bins with a watermark keep theirs. Taken again after another IDLE_UNMAP_PASSES idle passes.
+     */
+    block_header *take_idle_cache()
+    {
+        if (_idle_passes < IDLE_UNMAP_PASSES || _floor.load(std::memory_order_relaxed) > 0)
+            return nullptr;
+        _idle_passes = 0;
+
+        block_header *cached = nullptr;
+        std::lock_guard<spin_lock> guard(_list_lock);
+        while (block_header *h = _free_list.pop())
+        {
+            h->unset_state(block_header::mergable);
+            h->as_queue_node().next = cached;
+            cached = h;
+        }
+        update_cached_bit();
+        return cached;
+    }
+
+    /**
+     * @brief 等级下降后，把ring_buffer中多出的批收回到缓存中，自己的claim不计入需求
+     */
     void reclaim_ring_buffer()
     {
-        if (_full_count > 10000)
+        for (int64_t surplus = available() - _full; surplus > 0; surplus--)
         {
-            int av = available();
-            for (int i = 0; i < av; i++)
+            int64_t claim_pos = claim(1);
+            _last_read_pos++; // not a thread's demand, keep it out of the next sample
+            if (claim_pos > _write_pos)
+                break; //other thread has consumed
+
+            block_header *h = get_block(claim_pos);
+            if (h)
             {
-                int64_t claim_pos = claim(1);
-                if (claim_pos <= av)
-                {
-                    block_header *h = get_block(claim_pos);
-                    if (h)
-                    {
-                        h->set_state(block_header::mergable); //set state mergable
-                        cache_block(h);
-                    }
-                }
-                else
-                    break; //other thread has consumed
+                clear_block(claim_pos);
+                cache_batch(h); //set state mergable
             }
-            _full_count = 0;
         }
     }
 
-    ring_buffer<block_header *, QUEUE_SIZE> _free_queue;
+private:
+    /**
+     * @brief 缓存变空或变非空时更新位图中本bin的位，调用者持有_list_lock
+     */
+    void update_cached_bit()
+    {
+        bool cached = !_free_list.empty();
+        if (!_cached_bits || cached == _cached_set)
+            return;
+        _cached_set = cached;
+        if (cached)
+            _cached_bits->fetch_or(_cached_mask, std::memory_order_relaxed);
+        else
+            _cached_bits->fetch_and(~_cached_mask, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 从缓存中提取内存块，取消可合并状态，调用者持有_list_lock
+     */
+    block_header *get_cache_block()
+    {
+        block_header *h = _free_list.pop();
+        if (h)
+            h->unset_state(block_header::mergable);
+        return h;
+    }
+
+    /**
+     * @brief 从缓存中提取一批内存块，由queue_state串联并以nullptr结尾，调用者持有_list_lock
+     */
+    block_header *get_cache_batch()
+    {
+        block_header *head = get_cache_block();
+        if (!head)
+            return nullptr;
+
+        block_header *tail = head;
+        int64_t bytes = head->size();
+        for (int64_t i = 1; i < _batch_num; i++)
+        {
+            block_header *h = _free_list.peek();
+            if (!h || bytes + h->size() > _batch_bytes)
+                break;
+            h = get_cache_block();
+            bytes += h->size();
+            tail->as_queue_node().next = h;
+            tail = h;
+        }
+        tail->as_queue_node().next = nullptr;
+        return head;
+    }
+
+    /**
+     * @brief 把一批内存块放回缓存，调用者持有_list_lock
+     */
+    void return_batch(block_header *h)
+    {
+        while (h)
+        {
+            block_header *nxt = h->as_queue_node().next;
+            h->set_state(block_header::mergable);
+            _free_list.push(h);
+            h = nxt;
+        }
+    }
+
+public:
+    ring_buffer<block_header *, QUEUE_SIZE> _free_queue; // every slot holds a batch of blocks
     std::atomic<int64_t> _read_pos; // written to by read thread
-    int64_t _pad[7];                // below this point is written to by gc thread
+    std::atomic<int64_t> _misses;   // slow path visits while nothing was published, see note_miss
+    int64_t _pad[6];                // below this point is written to by gc thread
 
     int64_t _write_pos; // read by consumers to know the last valid entry.
 
-    int64_t _full_count; // gc thread checked and found the queue full, no one want any
-    int64_t _full;       // limit the number of blocks kept in queue
+    int64_t _full;          // level: the number of batches kept in queue
+    int64_t _last_read_pos; // _read_pos seen by the previous pass
+    int64_t _last_misses;   // _misses seen by the previous pass
+    int64_t _shrink_passes; // passes the forecast stayed below the level
+    int64_t _idle_passes;   // passes in a row without claims or misses
+    double _demand;         // ewma of claims per gc pass
+    std::atomic<int64_t> _floor; // watermark: the level never drops below it, see fc_warmup
+
+    int64_t _batch_num;   // blocks per batch
+    int64_t _batch_bytes; // bytes per batch
 
+    spin_lock _list_lock;  // taken by the gc thread, and by starving threads on the slow path
     block_list _free_list; // blocks are stored as a double-linked list
+    std::atomic<uint64_t> *_cached_bits; // bitmap of bins with cached blocks, see track_cached
+    uint64_t _cached_mask;               // our bit in it
+    bool _cached_set;                    // our bit is set, under _list_lock
+
+    static std::atomic<int> _starving;
+    static std::atomic<int> _pressure;
 };
 
+inline std::atomic<int> recycle_bin::_starving(0);
+inline std::atomic<int> recycle_bin::_pressure(0);
+
 #endif
\ No newline at end of file
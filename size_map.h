@@ -1,3 +1,6 @@
+#ifndef SIZE_MAP
+#define SIZE_MAP
+
 #include <stddef.h>
 #include <stdint.h>
 #include <sizeclass.h>
@@ -58,40 +61,29 @@ private:
     {
         if ((s <= kMaxSmallSize))
             return (static_cast<uint32_t>(s) + 7) >> 3;
-        else if (s <= kMaxSize)
-            return (static_cast<uint32_t>(s) + 127 + (120 << 7)) >> 7;
+        else
+            return (static_cast<uint32_t>(s) + 127 + (120 << 7)) >> 7; // callers stay within kMaxSize
     }
 
     // class_array_ is accessed on every malloc
     unsigned char class_array_[kClassArraySize];
 };
 
-void sizemap::init_class_array()
+inline void sizemap::init_class_array()
 {
-    // Mapping from size class to max size storable in that class
-    uint32_t class_to_size_[kNumClasses];
-    uint32_t class_to_nrbin_[kNumClasses];
-
-    for (int x = 0; x < kNumClasses; x++)
+    int next_size = 0;
+    //遍历所有大小类
+    for (size_t c = 1; c < kNumClasses; c++)
     {
-        class_to_size_[x] = kSizeClasses[kNumClasses].size;
+        const int max_size_in_class = kSizeClasses[c].size;
 
-        int next_size = 0;
-        //遍历所有大小类
-        for (int c = 1; c < kNumClasses; c++)
+        //遍历所有8递增的size，计算其大小类
+        for (int s = next_size; s <= max_size_in_class; s += kAlignment)
         {
-            const int max_size_in_class = class_to_size_[c];
-
-            //遍历所有8递增的size，计算其大小类
-            for (int s = next_size; s <= max_size_in_class; s += kAlignment)
-            {
-                class_array_[ClassIndex(s)] = c;
-            }
-            next_size = max_size_in_class + kAlignment;
-            if (next_size > kMaxSize)
-            {
-                break;
-            }
+            class_array_[ClassIndex(s)] = c;
         }
+        next_size = max_size_in_class + kAlignment;
     }
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SPIN_LOCK
+#define SPIN_LOCK
+
+#include <atomic>
+#include <sched.h>
+
+/**
+ * @brief 轻量自旋锁，只用于很短的临界区
+ */
+class spin_lock
+{
+public:
+    spin_lock() : _locked(false) {}
+
+    bool try_lock()
+    {
+        return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void lock()
+    {
+        while (!try_lock())
+            sched_yield();
+    }
+
+    void unlock()
+    {
+        _locked.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<bool> _locked;
+};
+
+#endif
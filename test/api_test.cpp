@@ -0,0 +1,385 @@
+/**
+ *   Behaviour tests of the C API.
+ *
+ *   Covers free/alloc round trips of every size range, cross-thread frees, arenas and their reset,
+ *   reuse of freed large blocks for smaller sizes, compact heaps, fc_alloc_near, allocation tags
+ *   with their soft limits, the heap limit callback, unmapping of idle chunks, fc_retire, frees after
+ *   the heap of a thread is gone and frees of null. Every check that fails is printed, the exit code
+ *   is the number of failures.
+ *
+ *   build:
+ *      g++ -O1 -std=c++17 -I.. api_test.cpp ../malloc.cpp -o api_test -lpthread
+ *
+ *   usage: api_test
+ */
+#include <atomic>
+#include <new>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fc_malloc.h"
+#include "os.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do                                                                       \
+    {                                                                        \
+        if (!(cond))                                                         \
+        {                                                                    \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+static void fill(void *p, size_t s)
+{
+    memset(p, (int)(s & 0xff), s);
+}
+
+static bool intact(const void *p, size_t s)
+{
+    const unsigned char *c = static_cast<const unsigned char *>(p);
+    for (size_t i = 0; i < s; i += 61)
+        if (c[i] != (unsigned char)(s & 0xff))
+            return false;
+    return c[s - 1] == (unsigned char)(s & 0xff);
+}
+
+// small, large, medium and huge blocks keep their contents while live and can be freed
+static void test_round_trips()
+{
+    const size_t sizes[] = {1, 8, 16, 24, 100, 336, 337, 1000, 4096, 60000, 300000, 5 << 20, 40 << 20};
+    for (int round = 0; round < 3; round++)
+    {
+        std::vector<std::pair<void *, size_t>> live;
+        for (size_t s : sizes)
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                void *p = operator new(s);
+                CHECK(p != nullptr);
+                CHECK(reinterpret_cast<uintptr_t>(p) % 8 == 0);
+                fill(p, s);
+                live.push_back({p, s});
+            }
+        }
+        for (auto &e : live)
+            CHECK(intact(e.first, e.second));
+        for (auto &e : live)
+            operator delete(e.first);
+    }
+}
+
+// objects freed by another thread than the one that allocated them
+static void test_cross_thread_free()
+{
+    const size_t num = 20000;
+    std::vector<void *> v(num);
+    std::thread producer([&] {
+        for (size_t i = 0; i < num; i++)
+        {
+            size_t s = i % 2 ? i % 300 + 1 : i % 5000 + 337;
+            v[i] = fc_malloc_flags(s, 0);
+            fill(v[i], s);
+        }
+    });
+    producer.join();
+
+    std::thread consumer([&] {
+        for (size_t i = 0; i < num; i++)
+        {
+            size_t s = i % 2 ? i % 300 + 1 : i % 5000 + 337;
+            CHECK(intact(v[i], s));
+            operator delete(v[i]);
+        }
+    });
+    consumer.join();
+}
+
+// a reset arena hands out its first chunk again, size classes reuse freed objects
+static void test_arena()
+{
+    fc_arena_t *a = fc_arena_create(0);
+    char *first = static_cast<char *>(fc_arena_alloc(a, 100));
+    CHECK(first != nullptr);
+    for (int i = 0; i < 100000; i++)
+    {
+        void *p = fc_arena_alloc(a, 200);
+        CHECK(p != nullptr);
+        fill(p, 200);
+    }
+    void *big = fc_arena_alloc(a, 1 << 20);
+    fill(big, 1 << 20);
+    fc_arena_reset(a);
+    CHECK(fc_arena_alloc(a, 100) == first);
+    fc_arena_destroy(a);
+
+    fc_arena_t *c = fc_arena_create(FC_ARENA_SIZE_CLASSES);
+    void *p = fc_arena_alloc(c, 64);
+    fc_arena_alloc(c, 64);
+    fc_arena_free(c, p);
+    CHECK(fc_arena_alloc(c, 64) == p);
+    fc_arena_destroy(c);
+}
+
+// freed large blocks are split for smaller sizes instead of mapping new chunks
+static void test_large_reuse()
+{
+    std::vector<void *> v;
+    v.reserve(256);
+    for (int i = 0; i < 256; i++)
+        v.push_back(fc_malloc_flags(60000, 0));
+    for (void *p : v)
+        operator delete(p);
+    v.clear();
+    usleep(100000); // let the gc thread merge and cache them
+
+    int64_t mapped = os::mapped_bytes();
+    for (int i = 0; i < 256; i++)
+    {
+        void *p = fc_malloc_flags(30000, 0);
+        fill(p, 30000);
+        v.push_back(p);
+    }
+    CHECK(os::mapped_bytes() <= mapped);
+    for (void *p : v)
+        operator delete(p);
+}
+
+// compact objects round trip through their handles from several threads, their chunks count as mapped
+static void test_compact()
+{
+    int64_t before = os::mapped_bytes();
+    fc_compact_t *heap = fc_compact_create(64 << 20);
+    CHECK(heap != nullptr);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([heap, t] {
+            std::vector<uint32_t> handles;
+            for (int i = 0; i < 5000; i++)
+            {
+                size_t s = (i * 7 + t) % 3000 + 1;
+                void *p = fc_compact_alloc(heap, s);
+                CHECK(p != nullptr);
+                fill(p, s);
+                handles.push_back(fc_compact_encode(heap, p));
+            }
+            for (int i = 0; i < 5000; i++)
+            {
+                size_t s = (i * 7 + t) % 3000 + 1;
+                void *p = fc_compact_decode(heap, handles[i]);
+                CHECK(intact(p, s));
+                fc_compact_free(heap, p);
+            }
+        });
+    }
+    for (std::thread &t : threads)
+        t.join();
+    CHECK(os::mapped_bytes() >= before + (4 << 20));
+
+    fc_compact_destroy(heap);
+    CHECK(os::mapped_bytes() <= before + (1 << 20));
+}
+
+// objects near the hint land in its span, the stats count the hits
+static void test_alloc_near()
+{
+    fc_near_stats before, after;
+    fc_alloc_near_stats(&before);
+
+    void *hint = fc_malloc_flags(48, 0);
+    int same_span = 0;
+    std::vector<void *> v;
+    for (int i = 0; i < 8; i++)
+    {
+        void *p = fc_alloc_near(hint, 48);
+        fill(p, 48);
+        if ((reinterpret_cast<uintptr_t>(p) ^ reinterpret_cast<uintptr_t>(hint)) < 1024)
+            same_span++;
+        v.push_back(p);
+    }
+    CHECK(same_span > 0);
+
+    void *large = fc_malloc_flags(2000, 0);
+    void *q = fc_alloc_near(large, 3000);
+    fill(q, 3000);
+    v.push_back(q);
+
+    fc_alloc_near_stats(&after);
+    CHECK(after.hits + after.misses == before.hits + before.misses + 9);
+    CHECK(after.hits >= before.hits + (uint64_t)same_span);
+
+    for (void *p : v)
+        operator delete(p);
+    operator delete(hint);
+    operator delete(large);
+}
+
+static std::atomic<int> tag_callbacks(0);
+
+static void on_tag_limit(int tag, int64_t live_bytes, int64_t limit, void *)
+{
+    if (tag == 3 && live_bytes > limit)
+        tag_callbacks++;
+}
+
+// live bytes are charged to the tag of the allocating thread and the soft limit calls back
+static void test_tags()
+{
+    CHECK(fc_set_tag(FC_MAX_TAGS) == -1);
+    CHECK(fc_tag_get_stats(-1, nullptr) == -1);
+
+    fc_tag_stats before, live, after;
+    fc_tag_get_stats(3, &before);
+    fc_tag_set_limit_callback(on_tag_limit, nullptr);
+    CHECK(fc_tag_set_limit(3, 1 << 20) == 0);
+
+    int old = fc_set_tag(3);
+    std::vector<void *> v;
+    for (int i = 0; i < 4096; i++)
+        v.push_back(fc_malloc_flags(1000, 0));
+    fc_set_tag(old);
+
+    fc_tag_get_stats(3, &live);
+    CHECK(live.allocs >= before.allocs + 4096);
+    CHECK(live.live_bytes >= before.live_bytes + 4096 * 1000);
+
+    for (int i = 0; i < 100 && tag_callbacks == 0; i++)
+        usleep(10000);
+    CHECK(tag_callbacks > 0);
+
+    for (void *p : v)
+        operator delete(p);
+    fc_tag_get_stats(3, &after);
+    CHECK(after.frees >= before.frees + 4096);
+    CHECK(after.live_bytes < live.live_bytes);
+
+    fc_tag_set_limit(3, 0);
+    fc_tag_set_limit_callback(nullptr, nullptr);
+}
+
+static std::atomic<int> heap_callbacks(0);
+
+static void on_heap_limit(int64_t, size_t, int64_t, void *)
+{
+    heap_callbacks++;
+}
+
+// a mapping that crosses the soft limit calls back first and still succeeds
+static void test_heap_limit()
+{
+    int64_t old = fc_get_heap_limit();
+    fc_set_heap_limit_callback(on_heap_limit, nullptr);
+    fc_set_heap_limit(1 << 20);
+    CHECK(fc_get_heap_limit() == 1 << 20);
+
+    void *p = fc_malloc_flags(64 << 20, 0);
+    CHECK(p != nullptr);
+    fill(p, 64 << 20);
+    CHECK(heap_callbacks > 0);
+    operator delete(p);
+
+    fc_set_heap_limit(old);
+    fc_set_heap_limit_callback(nullptr, nullptr);
+}
+
+// whole chunks that sit cached without demand are unmapped, also below the heap limit
+static void test_idle_unmap()
+{
+    std::vector<void *> v;
+    for (int i = 0; i < 1024; i++)
+        v.push_back(fc_malloc_flags(60000, 0));
+    int64_t mapped = os::mapped_bytes();
+    for (void *p : v)
+        operator delete(p);
+    fc_thread_cache_flush(); // hands over the split tails and the frees still on deck
+
+    for (int i = 0; i < 300 && os::mapped_bytes() > mapped - (32 << 20); i++)
+        usleep(10000);
+    CHECK(os::mapped_bytes() <= mapped - (32 << 20));
+}
+
+// retired objects are freed by the gc thread once the epoch moved on, without waiting for more frees
+static void test_retire()
+{
+    fc_tag_stats before, after;
+    fc_tag_get_stats(5, &before);
+
+    // a fresh thread, so the span the objects come from is charged to the tag
+    std::thread t([] {
+        fc_set_tag(5);
+        for (int i = 0; i < 10; i++)
+            fc_retire(fc_malloc_flags(48, 0));
+        fc_quiescent();
+    });
+    t.join();
+
+    for (int i = 0; i < 200; i++)
+    {
+        fc_quiescent();
+        fc_tag_get_stats(5, &after);
+        if (after.frees >= before.frees + 10)
+            break;
+        usleep(10000);
+    }
+    CHECK(after.frees >= before.frees + 10);
+}
+
+struct late_free
+{
+    void *p = nullptr;
+    ~late_free() { operator delete(p); }
+};
+
+static thread_local late_free late;
+
+// a thread_local destroyed after the thread's heap frees through the gc thread
+static void test_free_after_exit()
+{
+    for (int i = 0; i < 16; i++)
+    {
+        std::thread t([] {
+            late.p = nullptr; // constructed before the heap, so destroyed after it
+            late.p = operator new(100);
+        });
+        t.join();
+    }
+}
+
+// null pointers are ignored by every free
+static void test_free_null()
+{
+    operator delete(nullptr);
+    operator delete(nullptr, sizeof(int));
+    operator delete[](nullptr);
+    delete static_cast<int *>(nullptr);
+}
+
+int main()
+{
+    test_round_trips();
+    test_cross_thread_free();
+    test_arena();
+    test_large_reuse();
+    test_compact();
+    test_alloc_near();
+    test_tags();
+    test_heap_limit();
+    test_idle_unmap();
+    test_retire();
+    test_free_after_exit();
+    test_free_null();
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    else
+        printf("all checks passed\n");
+    return failures;
+}
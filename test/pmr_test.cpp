@@ -0,0 +1,123 @@
+/**
+ *   Behaviour tests of the C++ allocators in fc_allocator.h.
+ *
+ *   Allocates every size range at alignments from 8 bytes to 64 KB through fc_memory_resource, and
+ *   runs containers on fc_stl_allocator, fc_node_allocator and a pmr pool on top of the resource.
+ *   Every check that fails is printed, the exit code is the number of failures.
+ *
+ *   build:
+ *      g++ -O1 -std=c++17 -I.. pmr_test.cpp ../malloc.cpp -o pmr_test -lpthread
+ *
+ *   usage: pmr_test
+ */
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fc_allocator.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                          \
+    do                                                                       \
+    {                                                                        \
+        if (!(cond))                                                         \
+        {                                                                    \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+// aligned blocks of every size range are aligned, writable and go back with their size
+static void test_aligned_resource()
+{
+    std::pmr::memory_resource *r = fc_memory_resource::get();
+    const size_t sizes[] = {1, 8, 24, 100, 300, 330, 400, 5000, 100000, 2 << 20, 40 << 20};
+    const size_t aligns[] = {8, 16, 32, 64, 4096, 65536};
+    for (int round = 0; round < 20; round++)
+    {
+        std::vector<std::tuple<void *, size_t, size_t>> live;
+        for (size_t s : sizes)
+        {
+            for (size_t a : aligns)
+            {
+                void *p = r->allocate(s, a);
+                CHECK(p != nullptr);
+                CHECK(reinterpret_cast<uintptr_t>(p) % a == 0);
+                memset(p, (int)(s + a), s);
+                live.emplace_back(p, s, a);
+            }
+        }
+        for (auto &e : live)
+        {
+            const unsigned char *c = static_cast<const unsigned char *>(std::get<0>(e));
+            size_t s = std::get<1>(e), a = std::get<2>(e);
+            CHECK(c[0] == (unsigned char)(s + a) && c[s - 1] == (unsigned char)(s + a));
+            r->deallocate(std::get<0>(e), s, a);
+        }
+    }
+    CHECK(r->is_equal(*fc_memory_resource::get()));
+
+    // a size of 0 does not know the block, it is looked up by address
+    void *large = r->allocate(5000, 8);
+    r->deallocate(large, 0, 8);
+}
+
+// an aligned block freed by another thread
+static void test_cross_thread_aligned()
+{
+    std::pmr::memory_resource *r = fc_memory_resource::get();
+    std::vector<void *> v;
+    for (int i = 0; i < 1000; i++)
+        v.push_back(r->allocate(i % 2 ? 48 : 3000, i % 2 ? 16 : 256));
+    std::thread t([&] {
+        for (int i = 0; i < 1000; i++)
+            r->deallocate(v[i], i % 2 ? 48 : 3000, i % 2 ? 16 : 256);
+    });
+    t.join();
+}
+
+struct alignas(64) line
+{
+    char bytes[64];
+};
+
+// containers keep their elements and over-aligned types stay aligned
+static void test_containers()
+{
+    std::vector<line, fc_stl_allocator<line>> lines(1000);
+    CHECK(reinterpret_cast<uintptr_t>(lines.data()) % 64 == 0);
+
+    std::map<int, std::string, std::less<int>, fc_node_allocator<std::pair<const int, std::string>>> m;
+    for (int i = 0; i < 10000; i++)
+        m[i] = std::to_string(i);
+    for (int i = 0; i < 10000; i += 2)
+        m.erase(i);
+    CHECK(m.size() == 5000 && m[9999] == "9999");
+
+    std::pmr::unsynchronized_pool_resource pool(fc_memory_resource::get());
+    std::pmr::list<std::pmr::string> l(&pool);
+    for (int i = 0; i < 10000; i++)
+        l.emplace_back(std::string(i % 100, 'x'));
+    CHECK(l.size() == 10000 && l.back().size() == 9999 % 100);
+}
+
+int main()
+{
+    test_aligned_resource();
+    test_cross_thread_aligned();
+    test_containers();
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    else
+        printf("all checks passed\n");
+    return failures;
+}
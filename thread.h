@@ -7,19 +7,40 @@
  *
  *   The garbage collector can grow these queues as necessary and shrink them as time progresses.
  */
+#ifndef THREAD
+#define THREAD
+
 #include "common.h"
 #include "block_header.h"
 #include "bin_allocator.h"
 #include "recycle_bin.h"
 #include "size_map.h"
 #include "page_map.h"
+#include "medium_heap.h"
+#include "huge_cache.h"
+#include "arena.h"
+#include "compact_heap.h"
+#include "fc_malloc.h"
 #include "os.h"
+#include <chrono>
+#include <pthread.h>
 
 #define LOG2(X) ((unsigned)(8 * sizeof(unsigned long long) - __builtin_clzll((X)) - 1))
 
 class garbage_collector;
 class thread_allocator_gc;
 
+/**
+ * @brief 一批等待安全回收的对象，全局epoch比交接时前进两次后由gc线程释放
+ */
+struct retire_batch
+{
+    retire_batch *next;
+    uint64_t epoch; // global epoch when the batch was handed to the gc thread
+    size_t num;
+    char *ptrs[RETIRE_BATCH_NUM];
+};
+
 //thread private，all the member will be allocated in mmap area
 class thread_allocator
 {
@@ -29,84 +50,342 @@ class thread_allocator
 private:
     uint64_t _done;          // use by gc to cleanup and remove from list.
     thread_allocator *_next; // used by gc to link thread_allocs together
+    thread_allocator *_prev; // back link, written under the gc's _pool_lock
+
+    std::atomic<uint64_t> _alloc_epoch;  // bumped on every alloc and free, only we write it
+    uint64_t _seen_epoch;                // _alloc_epoch at the gc's previous idle scan, gc thread only
+    std::atomic<bool> _flush_requested;  // set by gc when we looked idle, checked on the next alloc or free
+    spin_lock _cache_lock;               // held while we use the caches, taken by gc to reclaim them when we are idle
+
+    std::atomic<uint64_t> _quiescent_epoch; // last global epoch we announced, 0 while we take no part
+    retire_batch *_retire_batch;            // objects retired since the last hand-off
+
+    char *_free_buffer[FREE_BUFFER_NUM];           // small frees not applied to their span bitmaps yet
+    size_t _free_num;
+    block_header *_empty_span[2][NUM_SMALL_BINS + 1]; // one empty span kept per lifetime and class before releasing to gc
+    int _lifetime;                                    // FC_LONG_LIVED for allocations that do not pass a lifetime
+    uint64_t _near_hits;                              // alloc_near stats, read by other threads without sync
+    uint64_t _near_misses;
+    block_header *_partial_span[2][NUM_SMALL_BINS + 1]; // a span that had been full and got frees, filled first by alloc_for_move
+    int64_t _class_bytes[NUM_SMALL_BINS + 1];           // small bytes allocated minus freed by this thread, read by gc without sync
+    int64_t _class_spans[NUM_SMALL_BINS + 1];           // spans taken minus spans given back by this thread
+    int _tag;                                           // tag charged for our allocations, see fc_set_tag
+    int64_t _tag_bytes[FC_MAX_TAGS];                    // per tag counters, read by gc without sync
+    uint64_t _tag_allocs[FC_MAX_TAGS];
+    uint64_t _tag_frees[FC_MAX_TAGS];
 
     garbage_collect _garbage_collect;
 
-    bin_allocator<NUM_LARGE_BINS, 0> _large_bin_allocator;
-    fixed_bin_allocator<NUM_SMALL_BINS, SMALL_BIN_SIZE> _small_bin_allocator;
+    typedef bin_allocator<NUM_LARGE_BINS, 0> large_allocator_t;
+    typedef fixed_bin_allocator<NUM_SMALL_BINS, SMALL_BIN_SIZE> small_allocator_t;
+
+    large_allocator_t _large_bin_allocator;
+    small_allocator_t _small_bin_allocator;
+    large_allocator_t _long_large_bin_allocator; // long lived blocks, cut from their own chunks
+    small_allocator_t _long_small_bin_allocator; // long lived objects, in their own spans
     fixed_bin_allocator<1, LEAF_SIZE> _meta_bin_allocator;
 
+    /**
+     * @brief 分配的主体，不计标签
+     */
+    char *alloc_block(size_t s, int flags);
+
+    void bump_epoch()
+    {
+        _alloc_epoch.store(_alloc_epoch.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
 public:
-    char *alloc(size_t s);
+    char *alloc(size_t s, int flags = 0)
+    {
+        char *p = alloc_block(s, flags);
+        if (p && s > SMALL_BLOCK) // small objects are charged in alloc_small
+            charge_large(p);
+        return p;
+    }
+
+    /**
+     * @brief 按align对齐分配，align不超过MIN_BLOCK_SIZE时就是alloc
+     *
+     *  Small classes above 8 bytes are multiples of 16 and objects start 8 bytes into their span, so a 16
+     *  byte alignment takes the object 8 bytes bigger and skips its first word. Larger alignments carve the
+     *  aligned block out of a large block, or mark an aligned pointer inside a medium or huge block.
+     */
+    char *alloc_aligned(size_t s, size_t align);
+
+    /**
+     * @brief 一次分配n个同样大小的块，小块只查一次大小类并从当前单元块连续分配
+     */
+    void alloc_batch(size_t s, size_t n, char **out);
 
     char *alloc_small(int bin, block_header *h, bin_info &binfo)
     {
         int flag_full = 0;
         char *p = binfo.alloc(h, flag_full);
+        _class_bytes[bin] += binfo.size;
+        _tag_bytes[binfo.tag] += binfo.size;
+        _tag_allocs[binfo.tag]++;
         if (flag_full)
-            _small_bin_allocator.clear_cache(bin);
+        {
+            small_allocator(h->is_longlived()).clear_cache(bin);
+            unclaim_span(h, bin, binfo);
+        }
         return p;
     }
 
+    small_allocator_t &small_allocator(bool long_lived)
+    {
+        return long_lived ? _long_small_bin_allocator : _small_bin_allocator;
+    }
+
+    large_allocator_t &large_allocator(bool long_lived)
+    {
+        return long_lived ? _long_large_bin_allocator : _large_bin_allocator;
+    }
+
     /**
-     * @brief 快速释放内存块
+     * @brief 设置本线程默认的寿命类别，返回之前的
      */
-    void free(char *c);
+    int set_lifetime(int flags)
+    {
+        int old = _lifetime;
+        _lifetime = flags & FC_LONG_LIVED;
+        return old;
+    }
 
-    void free_small(char *c, bin_info &binfo)
+    /**
+     * @brief 本线程默认的寿命类别
+     */
+    int get_lifetime() const
     {
-        block_header *h = reinterpret_cast<block_header *>(c);
-        int size = binfo.size;
-        int pos = garbage_collector::get_pos(h, size);
-        int flag_empty = 0;
-        binfo.free(pos, flag_empty);
-        if (flag_empty)
-            _garbage_collect.release(h);
+        return _lifetime;
+    }
+
+    /**
+     * @brief 二级缓存一次取的单元块数，接近堆上限时减少
+     */
+    static size_t list_cache_num(size_t n)
+    {
+        return std::max(n >> os::pressure(), (size_t)1);
+    }
+
+    /**
+     * @brief 设置本线程分配计入的标签，返回之前的，超出范围时返回-1
+     */
+    int set_tag(int tag)
+    {
+        if (tag < 0 || tag >= FC_MAX_TAGS)
+            return -1;
+        int old = _tag;
+        _tag = tag;
+        return old;
     }
 
     /**
-     * @brief 单例模式获取线程类
+     * @brief 块占用的字节数，巨大块的块头不记录大小，从映射长度得出
      */
-    static thread_allocator *get()
+    static size_t block_bytes(block_header *h)
     {
-        static __thread thread_allocator *tld = nullptr;
+        return h->size() ? h->size() : huge_header::from_block(h)->map_size;
+    }
+
+    /**
+     * @brief 大块、中等块和巨大块在块头记下标签并计数
+     */
+    void charge_large(char *c)
+    {
+        block_header *h = reinterpret_cast<block_header *>(c - HEDER_SIZE);
+        h->set_tag(_tag);
+        _tag_bytes[_tag] += block_bytes(h);
+        _tag_allocs[_tag]++;
+    }
+
+    /**
+     * @brief 在hint附近分配：本线程正在用的hint所在单元块，或hint旁边的空闲单元块和大块，都不行才走正常路径
+     */
+    char *alloc_near(const char *hint, size_t s);
+
+    /**
+     * @brief 小块位于稀疏的单元块，且所在大小类整体利用率不高时返回true，本线程正在填充的单元块除外
+     */
+    bool should_move(const char *p);
+
+    /**
+     * @brief 为搬迁的对象分配，优先填充本线程能用的最满的单元块
+     */
+    char *alloc_for_move(size_t s);
+
+    /**
+     * @brief 预热：分配count个对象并写一遍，再全部释放，各级缓存中留下已缺页的单元块和大块
+     */
+    void warmup(size_t s, size_t count);
+
+    /**
+     * @brief 新单元块建立映射
+     */
+    void init_span_mapping(block_header *h);
+
+    /**
+     * @brief 长寿命的大块，只在自己的bin中查找，新大块打上长寿命标记
+     */
+    char *alloc_large_long_lived(size_t s);
+
+    /**
+     * @brief 切割大块，剩余部分放入一级缓存或交给垃圾回收器。块比s小时交给垃圾回收器并返回nullptr
+     */
+    char *split_large(block_header *h, size_t s);
+
+    /**
+     * @brief 快速释放内存块
+     */
+    void free(char *c);
 
-        if (!tld)
+    /**
+     * @brief 调用者知道分配时的大小和对齐，小块不需要查找映射
+     */
+    void free_sized(char *c, size_t s, size_t align = 0);
+
+    /**
+     * @brief 释放大块、中等块和巨大块
+     */
+    void free_large(char *c);
+
+    /**
+     * @brief 饥饿时从其他线程的窃取槽中整批取块，最多探测FC_OPT_STEAL_VICTIMS个线程
+     */
+    template <typename allocator_t>
+    block_header *steal_from_siblings(allocator_t thread_allocator::*member);
+
+    /**
+     * @brief 延迟释放，对象先放入本线程的一批中，满了交给gc线程
+     */
+    void retire(char *p)
+    {
+        if (!_retire_batch)
         {
-            tld = reinterpret_cast<thread_allocator *>(os::mmap_alloc(sizeof(thread_allocator)));
+            _retire_batch = reinterpret_cast<retire_batch *>(alloc(sizeof(retire_batch)));
+            _retire_batch->num = 0;
+        }
+        _retire_batch->ptrs[_retire_batch->num++] = p;
+        if (_retire_batch->num == RETIRE_BATCH_NUM)
+            hand_off_retired();
+    }
+
+    /**
+     * @brief 宣布静止状态，并交出未满的一批，避免它等到下一批满
+     */
+    void quiescent();
+
+    /**
+     * @brief 用当前epoch标记这一批，交给gc线程
+     */
+    void hand_off_retired();
 
-            thread_allocator::constructor(tld);
+    /**
+     * @brief 把一级大块缓存和二级缓存还给全局池，小块一级缓存中的单元块还有对象在用，保留
+     */
+    void flush_caches();
 
-            //allocate pthread_threadlocal var, attach a destructor /clean up callback to that variable
-            thread_local thread_allocator_gc tlv;
+    /**
+     * @brief 小块释放先放入缓冲区，满了再按单元块分组更新位图
+     */
+    void free_small(char *c)
+    {
+        _free_buffer[_free_num++] = c;
+        if (_free_num == FREE_BUFFER_NUM)
+        {
+            std::lock_guard<spin_lock> guard(_cache_lock);
+            flush_free_buffer();
         }
-        return tld;
     }
 
-private:
-    thread_allocator();
+    /**
+     * @brief 按地址排序缓冲区，同一单元块的释放只查找一次映射，变空的单元块检查一次。调用者持有_cache_lock
+     */
+    void flush_free_buffer();
 
-    ~thread_allocator();
+    /**
+     * @brief 满过的单元块有了空位后不在任何缓存中，记下它供alloc_for_move填充，只保留更满的一个
+     */
+    void keep_partial_span(block_header *span, int bin, bin_info &binfo);
+
+    /**
+     * @brief 占有单元块。只有占有者把单元块放入缓存或记下，也只有它能把变空的单元块交出去
+     */
+    bool claim_span(bin_info &binfo)
+    {
+        thread_allocator *expected = nullptr;
+        return binfo.owner.load(std::memory_order_relaxed) == this || binfo.owner.compare_exchange_strong(expected, this);
+    }
 
-    static void constructor(thread_allocator *tp)
+    /**
+     * @brief 放弃占有，占有期间被其他线程释放空了的单元块由我们交给垃圾回收器
+     */
+    void unclaim_span(block_header *span, int bin, bin_info &binfo)
     {
-        tp->_done = false;
-        tp->_next = nullptr;
-        tp->_garbage_collect.constructor();
-        tp->_large_bin_allocator.constructor();
-        tp->_small_bin_allocator.constructor();
-        tp->_meta_bin_allocator.constructor();
-        garbage_collector::get().register_allocator(tp);
+        // pairs with the fence in flush_free_buffer: either the last free sees the owner gone, or we see it empty
+        binfo.owner.store(nullptr, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (binfo.bindex.empty() && claim_span(binfo))
+            release_span(span, bin);
     }
 
-    static void destructor(thread_allocator *tp)
+    /**
+     * @brief 每个大小类保留一个空单元块，再有变空的才交给垃圾回收器，避免释放后马上分配的来回
+     */
+    void release_empty_span(block_header *span, int bin)
     {
-        tp->_done = 1; //final release by gc via ummap
-        // give the rest of our allocated chunks to the gc thread
-        tp->_large_bin_allocator.destructor(tp->_garbage_collect);
-        tp->_small_bin_allocator.destructor(tp->_garbage_collect);
-        tp->_meta_bin_allocator.destructor(tp->_garbage_collect);
+        bool long_lived = span->is_longlived();
+        if (span == small_allocator(long_lived).get_cache(bin))
+            return; // still the span we allocate from
+        if (span == _partial_span[long_lived][bin])
+            _partial_span[long_lived][bin] = nullptr;
+        if (!_empty_span[long_lived][bin] && !os::pressure())
+        {
+            _empty_span[long_lived][bin] = span;
+            return;
+        }
+        release_span(span, bin);
     }
+
+    /**
+     * @brief 空单元块清除映射后交给垃圾回收器
+     */
+    void release_span(block_header *span, int bin);
+
+    /**
+     * @brief 单例模式获取线程类，优先复用已退出线程的分配器
+     */
+    static thread_allocator *get();
+
+    /**
+     * @brief 释放入口。本线程的分配器销毁后，更晚执行的thread_local析构函数释放的对象交给gc线程，不再创建分配器
+     */
+    static void thread_free(char *c);
+
+    static void thread_free_sized(char *c, size_t s, size_t align = 0);
+
+    /**
+     * @brief 创建不绑定线程的分配器，由调用者保证同一时刻只有一个线程使用
+     */
+    static thread_allocator *create();
+
+    /**
+     * @brief 销毁create创建的分配器，缓存还给全局池，gc线程取完剩下的垃圾后复用它
+     */
+    static void release(thread_allocator *tp);
+
+private:
+    static __thread thread_allocator *_tld;
+    static __thread bool _exiting; // our allocator is destroyed, the thread is running its last destructors
+
+    thread_allocator();
+
+    ~thread_allocator();
+
+    static void constructor(thread_allocator *tp);
+
+    static void destructor(thread_allocator *tp);
 };
 
 //callback to destruct thread_allocator
@@ -115,7 +394,7 @@ class thread_allocator_gc
 public:
     ~thread_allocator_gc()
     {
-        thread_allocator *tp = thread_allocator::get();
+        thread_allocator *tp = thread_allocator::_tld;
         if (tp != nullptr)
         {
             thread_allocator::destructor(tp);
@@ -140,35 +419,96 @@ class garbage_collector
 {
 public:
     garbage_collector()
-        : smap(), _thread_head(nullptr), _thread(&garbage_collector::run) {}
+        : _thread_head(nullptr), _epoch(1), _retired_head(nullptr), _retired(nullptr), _orphan_head(nullptr), _allocator_pool(nullptr), _near_hits(0), _near_misses(0), _tag_limit_fn(nullptr), _tag_limit_arg(nullptr), _dirty(nullptr), _backlog(nullptr), _nonempty_bins(0), _cached_bins(0), smap()
+    {
+        //每个槽位发布一批内存块，线程一次claim取走整批
+        for (size_t i = 0; i <= NUM_LARGE_BINS; i++)
+        {
+            bit_index mask;
+            mask.set(i);
+            _bins[i].track_cached(&_cached_bins, mask.bits());
+            _bins[i].set_batch(TRANSFER_BATCH_NUM, TRANSFER_BATCH_BYTES);
+            _long_bins[i].set_batch(TRANSFER_BATCH_NUM, TRANSFER_BATCH_BYTES);
+        }
+        _algin_bin.set_batch(TRANSFER_BATCH_NUM, TRANSFER_BATCH_NUM * SMALL_BIN_CAPCITY);
+        _long_algin_bin.set_batch(TRANSFER_BATCH_NUM, TRANSFER_BATCH_NUM * SMALL_BIN_CAPCITY);
+        _meta_bin.set_batch(1, 0);
+
+        //还没有汇总过时当作利用率已满，不建议搬迁
+        memset(_class_bytes, 0, sizeof(_class_bytes));
+        memset(_class_spans, 0, sizeof(_class_spans));
+        for (size_t i = 0; i < NUM_SMALL_BINS + 1; i++)
+            _class_util_pct[i].store(100, std::memory_order_relaxed);
+        memset(_tag_stats, 0, sizeof(_tag_stats));
+        memset(_tag_over, 0, sizeof(_tag_over));
+        for (size_t i = 0; i < FC_MAX_TAGS; i++)
+            _tag_limit[i].store(0, std::memory_order_relaxed);
+
+        //容器中按cgroup内存限制设置软上限
+        os::set_soft_limit_from_cgroup(nullptr);
+
+        // std::thread would allocate its state with operator new, which comes back here
+        pthread_create(&_thread, nullptr, [](void *) -> void * { run(); return nullptr; }, nullptr);
+    }
 
     ~garbage_collector()
     {
         _done.store(true, std::memory_order_release);
-        _thread.join();
+        pthread_join(_thread, nullptr);
     }
 
     /**
      * @brief 核心思想是释放时候的计算延迟进行，所以这里通过标记来进行多台
      */
     recycle_bin &find_recycle_bin_for(block_header *h)
+    {
+        return find_recycle_bin_for(h, h->size());
+    }
+
+    recycle_bin &find_recycle_bin_for(block_header *h, int size)
     {
         if (h->is_aligned())
-            return _algin_bin;
+            return h->is_longlived() ? _long_algin_bin : _algin_bin;
         if (h->is_meta())
             return _meta_bin;
+        if (h->is_longlived())
+            return _long_bins[get_large_bin(size)];
         else
-            return _bins[get_size_class(h->size())];
+            return _bins[get_large_bin(size)];
+    }
+
+    /**
+     * @brief 从缓存中摘除块，bin按读到的一次大小选择，块已被取走或大小变了时返回false。经next->prev()找到的块传入next
+     */
+    bool take_cached_block(block_header *h, block_header *next = nullptr)
+    {
+        int size = h->size();
+        return find_recycle_bin_for(h, size).take_cached_block(h, size, next);
     }
 
-    recycle_bin &get_bin(int large_bin)
+    /**
+     * @brief 空闲块所在的大块bin：块能满足的最大的大小类，下标比大小类少NUM_SMALL_BINS
+     *
+     *  Every block of bin b serves any request whose class is b + NUM_SMALL_BINS, so takers do not look at
+     *  the size. Fragments too small for the smallest large class are kept in bin 0, which no request
+     *  reads; they only wait there to be merged.
+     */
+    int get_large_bin(size_t size)
+    {
+        size_t c = get_size_class(size + HEDER_SIZE);
+        if (kSizeClasses[c].size > size + HEDER_SIZE)
+            c--;
+        return std::max((int)c - NUM_SMALL_BINS, 0);
+    }
+
+    recycle_bin &get_bin(int large_bin, bool long_lived = false)
     {
-        return _bins[large_bin - NUM_SMALL_BINS];
+        return long_lived ? _long_bins[large_bin - NUM_SMALL_BINS] : _bins[large_bin - NUM_SMALL_BINS];
     }
 
-    recycle_bin &get_align_bin()
+    recycle_bin &get_align_bin(bool long_lived = false)
     {
-        return _algin_bin;
+        return long_lived ? _long_algin_bin : _algin_bin;
     }
 
     recycle_bin &get_meta_bin()
@@ -176,185 +516,911 @@ public:
         return _meta_bin;
     }
 
+    medium_heap &get_medium_heap()
+    {
+        return _medium_heap;
+    }
+
+    huge_cache &get_huge_cache()
+    {
+        return _huge_cache;
+    }
+
     /**
-     * @brief 用来合并recyclebin中缓存状态的内存块
+     * @brief 用来合并recyclebin中缓存状态的内存块，返回合并后的块
      */
-    void merge_block(block_header *h)
+    block_header *merge_block(block_header *h)
     {
+        //需要清除recyclebin中的缓存，相邻块可能刚被饥饿线程取走。取到的块已不可合并，直接吸收
         block_header *nxt_block = h->next();
-        if (nxt_block->is_mergable())
-        {
-            //需要清除recyclebin中的缓存
-            find_recycle_bin_for(nxt_block).clear_cached_block(nxt_block);
-            h = h->merge_next();
-        }
+        if (nxt_block && nxt_block->is_mergable() && take_cached_block(nxt_block))
+            h = h->absorb_next();
+
         block_header *prv_block = h->prev();
-        if (prv_block->is_mergable())
-        {
-            find_recycle_bin_for(prv_block).clear_cached_block(prv_block);
-            h = h->merge_prev();
-        }
+        if (prv_block && prv_block->is_mergable() && take_cached_block(prv_block))
+            h = prv_block->absorb_next();
+        return h;
     }
 
     /**
-     * @brief 本地线程调用用来注册自己
+     * @brief 合并后的块放入所在bin。接近堆上限时，合并回整个大块的直接解除映射
      */
-    void register_allocator(thread_allocator *ta)
+    void cache_or_unmap(block_header *h)
     {
-        thread_allocator *stale_head = _thread_head.load(std::memory_order_relaxed);
-        do
-        {
-            ta->_next = stale_head;
-        } while (!_thread_head.compare_exchange_weak(stale_head, ta, std::memory_order_release));
+        if (h->is_whole_page() && os::pressure())
+            os::mmap_free(h, h->size() + HEDER_SIZE);
+        else
+            find_recycle_bin_for(h).cache_block(h);
     }
 
     /**
-     * @brief 垃圾回收器调用用来解除线程的注册
+     * @brief 长期没有需求的bin的缓存按地址合并，合并回整个大块的解除映射，其余放回所在bin
+     *
+     *  Donated thread caches are cached without merging, so the pieces of a chunk only come together here.
      */
-    void register_allocator(thread_allocator *ta);
+    void unmap_idle_cache(recycle_bin &bin)
+    {
+        block_header *pass = bin.take_idle_cache();
+        if (!pass)
+            return;
+        pass = block_list::sort_by_address(pass);
+        block_list::coalesce_adjacent(pass);
+        while (pass)
+        {
+            block_header *nxt = pass->as_queue_node().next;
+            block_header *h = merge_block(pass);
+            if (h->is_whole_page())
+                os::mmap_free(h, h->size() + HEDER_SIZE);
+            else
+                find_recycle_bin_for(h).cache_block(h);
+            pass = nxt;
+        }
+    }
 
     /**
-     * @brief 单例模式获取类实例
+     * @brief 处理一串垃圾，直到工作量或时间预算用完，返回没处理的部分
      */
-    static garbage_collector &get();
-
-    /**
-    * @brief 获取大小类
-    */
-    size_t get_size_class(size_t t)
+    block_header *collect(block_header *cur, int64_t &budget, std::chrono::steady_clock::time_point deadline)
     {
-        return smap.get_sizeclass(t);
+        if (options::get(FC_OPT_DEFERRED_COALESCE))
+            return collect_sorted(cur, budget, deadline);
+
+        for (; cur && budget > 0; budget--)
+        {
+            if ((budget & 63) == 0 && std::chrono::steady_clock::now() > deadline)
+            {
+                budget = 0;
+                break;
+            }
+
+            block_header *nxt = cur->as_queue_node().next;
+            if (cur->is_bigdata()) // page run of the medium heap
+                _medium_heap.release(cur);
+            else
+                cache_or_unmap(merge_block(cur));
+            cur = nxt;
+        }
+        return cur;
     }
 
     /**
-     * @brief 获取按层次搜索recyclebin的跳跃层数
+     * @brief 延迟合并：本轮的垃圾先按地址排序，一次扫描合并相邻的块，再放入bin。有需求的bin中的块不合并
      */
-    int get_next_recycle_bin(int bin)
+    block_header *collect_sorted(block_header *cur, int64_t &budget, std::chrono::steady_clock::time_point deadline)
     {
-        return smap.get_next_recycle_bin(bin);
+        //摘下本轮预算内的垃圾，中等块直接归还
+        block_header *pass = nullptr;
+        for (; cur && budget > 0; budget--)
+        {
+            if ((budget & 63) == 0 && std::chrono::steady_clock::now() > deadline)
+            {
+                budget = 0;
+                break;
+            }
+
+            block_header *nxt = cur->as_queue_node().next;
+            if (cur->is_bigdata()) // page run of the medium heap
+                _medium_heap.release(cur);
+            else
+            {
+                cur->as_queue_node().next = pass;
+                pass = cur;
+            }
+            cur = nxt;
+        }
+
+        pass = block_list::sort_by_address(pass);
+        block_list::coalesce_adjacent(pass, [this](block_header *h, block_header *nxt) {
+            return !find_recycle_bin_for(h).has_demand() && !find_recycle_bin_for(nxt).has_demand();
+        });
+
+        while (pass)
+        {
+            block_header *nxt = pass->as_queue_node().next;
+            if (!find_recycle_bin_for(pass).has_demand())
+                pass = merge_block(pass);
+            cache_or_unmap(pass);
+            pass = nxt;
+        }
+        return cur;
     }
 
-    //////////////////////////////////////////////////映射相关API-start//////////////////////////////////////////////////
     /**
-     * @brief 获取bin_info
+     * @brief 本地线程调用用来注册自己
      */
-    bin_info &get_bin_info(block_header *h)
+    void register_allocator(thread_allocator *ta)
     {
-        return pmap.get(get_number(h));
+        std::lock_guard<spin_lock> guard(_pool_lock);
+        thread_allocator *head = _thread_head.load(std::memory_order_relaxed);
+        ta->_prev = nullptr;
+        ta->_next = head;
+        if (head)
+            head->_prev = ta;
+        _thread_head.store(ta, std::memory_order_release);
     }
 
     /**
-     * @brief 判断是否存在映射
+     * @brief 垃圾回收器调用用来解除线程的注册，分配器放入复用池
      */
-    static inline bool is_mapped(bin_info &binfo)
+    void unregister_allocator(garbage_collect *gcollect)
     {
-        return binfo.size == 0;
+        thread_allocator *ta = gcollect->owner();
+
+        // readers walk _next without the lock, an unlinked allocator keeps pointing into the lists
+        std::lock_guard<spin_lock> guard(_pool_lock);
+        if (ta->_prev)
+            ta->_prev->_next = ta->_next;
+        else
+            _thread_head.store(ta->_next, std::memory_order_release);
+        if (ta->_next)
+            ta->_next->_prev = ta->_prev;
+
+        _near_hits += ta->_near_hits;
+        _near_misses += ta->_near_misses;
+        for (size_t i = 0; i < NUM_SMALL_BINS + 1; i++)
+        {
+            _class_bytes[i] += ta->_class_bytes[i];
+            _class_spans[i] += ta->_class_spans[i];
+            ta->_class_bytes[i] = 0;
+            ta->_class_spans[i] = 0;
+        }
+        for (size_t i = 0; i < FC_MAX_TAGS; i++)
+        {
+            _tag_stats[i].live_bytes += ta->_tag_bytes[i];
+            _tag_stats[i].allocs += ta->_tag_allocs[i];
+            _tag_stats[i].frees += ta->_tag_frees[i];
+            ta->_tag_bytes[i] = 0;
+            ta->_tag_allocs[i] = 0;
+            ta->_tag_frees[i] = 0;
+        }
+        ta->_next = _allocator_pool;
+        _allocator_pool = ta;
     }
 
     /**
-     * @brief 判断是否初始化映射内部数据结构
+     * @brief 汇总alloc_near的命中率，已退出线程的计数在解除注册时并入，读取不做同步
      */
-    bool is_init(block_header *h)
+    void get_near_stats(fc_near_stats &st)
     {
-        return pmap.is_init(get_number(h));
+        {
+            std::lock_guard<spin_lock> guard(_pool_lock);
+            st.hits = _near_hits;
+            st.misses = _near_misses;
+        }
+        for (thread_allocator *ta = _thread_head.load(std::memory_order_acquire); ta; ta = ta->_next)
+        {
+            st.hits += ta->_near_hits;
+            st.misses += ta->_near_misses;
+        }
     }
 
     /**
-     * @brief 初始化映射内部数据结构
+     * @brief 汇总各小块大小类的利用率：在用字节数除以持有单元块的容量，由gc线程定期调用
      */
-    void init(block_header *h, block_header *meta_h)
+    void refresh_class_util()
     {
-        void *p = reinterpret_cast<void *>(meta_h);
-        pmap.init(get_number(h), p);
+        int64_t bytes[NUM_SMALL_BINS + 1], spans[NUM_SMALL_BINS + 1];
+        {
+            std::lock_guard<spin_lock> guard(_pool_lock);
+            memcpy(bytes, _class_bytes, sizeof(bytes));
+            memcpy(spans, _class_spans, sizeof(spans));
+        }
+        for (thread_allocator *ta = _thread_head.load(std::memory_order_acquire); ta; ta = ta->_next)
+        {
+            for (size_t i = 0; i < NUM_SMALL_BINS + 1; i++)
+            {
+                bytes[i] += ta->_class_bytes[i];
+                spans[i] += ta->_class_spans[i];
+            }
+        }
+        for (size_t i = 0; i < NUM_SMALL_BINS + 1; i++)
+        {
+            // the racy sums can be off for a moment, treat that as fully used
+            int64_t pct = spans[i] > 0 && bytes[i] >= 0 ? bytes[i] * 100 / (spans[i] * SMALL_BIN_SIZE) : 100;
+            _class_util_pct[i].store(pct, std::memory_order_relaxed);
+        }
     }
 
     /**
-     * @brief 获取在单元块中偏移量
+     * @brief 按预热的数量提高对应bin的水位下限，中等块和巨大块钉住预热的页不被修剪，count为0时取消
+     *
+     *  Small classes share one bin of spans, so a count of 0 for any of them resets the floor of all.
      */
-    static inline uint64_t get_pos(block_header *h, int size)
+    void set_watermark(size_t s, size_t count, bool long_lived)
     {
-        uint64_t ret = reinterpret_cast<uint64_t>(h);
-        return (ret & (1 << (SMALL_BIN_BITS + 1) - 1) - HEDER_SIZE) / size;
+        if (s < MIN_BLOCK_SIZE)
+            s = MIN_BLOCK_SIZE;
+        if (s <= SMALL_BLOCK)
+        {
+            size_t per_span = bin_info(kSizeClasses[get_size_class(s)].size).capacity();
+            size_t spans = (count + per_span - 1) / per_span;
+            raise_floor(get_align_bin(long_lived), (spans + TRANSFER_BATCH_NUM - 1) / TRANSFER_BATCH_NUM);
+        }
+        else if (s + HEDER_SIZE < LARGE_BLOCK)
+        {
+            size_t bin = get_size_class(s + HEDER_SIZE);
+            size_t bytes = kSizeClasses[bin].size;
+            size_t per_batch = std::max((size_t)1, std::min((size_t)TRANSFER_BATCH_NUM, (size_t)TRANSFER_BATCH_BYTES / bytes));
+            raise_floor(get_bin(bin, long_lived), (count + per_batch - 1) / per_batch);
+        }
+        else if (s + HEDER_SIZE <= MEDIUM_BLOCK)
+            _medium_heap.pin(count * ((s + HEDER_SIZE + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE));
+        else
+            _huge_cache.pin(count * huge_cache::map_size(s));
     }
-    //////////////////////////////////////////////////映射相关API-end//////////////////////////////////////////////////
 
-private:
-    static void run();
-
-    static inline pagemap::Number get_number(block_header *h)
+    /**
+     * @brief 水位模式：低于下限的bin缓存也空了时，gc线程映射新大块切好放入，每个bin每轮最多一个大块
+     */
+    bool prefill()
+    {
+        bool found_work = false;
+        for (int l = 0; l < 2; l++)
+        {
+            block_header::flags_enum lifetime = l ? block_header::longlived : block_header::unknown;
+            for (size_t i = 0; i <= NUM_LARGE_BINS; i++)
+            {
+                if (get_bin(i + NUM_SMALL_BINS, l).needs_prefill())
+                {
+                    carve_chunk(get_bin(i + NUM_SMALL_BINS, l), kSizeClasses[i + NUM_SMALL_BINS].size, lifetime);
+                    found_work = true;
+                }
+            }
+            if (get_align_bin(l).needs_prefill())
+            {
+                carve_chunk(get_align_bin(l), SMALL_BIN_SIZE, (block_header::flags_enum)(block_header::alignblock | lifetime));
+                found_work = true;
+            }
+        }
+        return found_work;
+    }
+
+    int64_t get_class_util_pct(int bin)
+    {
+        return _class_util_pct[bin].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 汇总一个标签的计数，已退出线程的计数在解除注册时并入，读取不做同步
+     */
+    void get_tag_stats(int tag, fc_tag_stats &st)
+    {
+        {
+            std::lock_guard<spin_lock> guard(_pool_lock);
+            st = _tag_stats[tag];
+        }
+        for (thread_allocator *ta = _thread_head.load(std::memory_order_acquire); ta; ta = ta->_next)
+        {
+            st.live_bytes += ta->_tag_bytes[tag];
+            st.allocs += ta->_tag_allocs[tag];
+            st.frees += ta->_tag_frees[tag];
+        }
+    }
+
+    void set_tag_limit(int tag, int64_t bytes)
+    {
+        _tag_limit[tag].store(bytes, std::memory_order_relaxed);
+    }
+
+    void set_tag_limit_callback(fc_tag_limit_fn fn, void *arg)
+    {
+        _tag_limit_arg.store(arg, std::memory_order_relaxed);
+        _tag_limit_fn.store(fn, std::memory_order_release);
+    }
+
+    /**
+     * @brief 检查各标签的软上限，超出时回调一次，回落到上限以下后重新计数，由gc线程定期调用
+     */
+    void check_tag_limits()
+    {
+        fc_tag_limit_fn fn = _tag_limit_fn.load(std::memory_order_acquire);
+        for (int i = 0; i < FC_MAX_TAGS; i++)
+        {
+            int64_t limit = _tag_limit[i].load(std::memory_order_relaxed);
+            if (limit <= 0)
+            {
+                _tag_over[i] = false;
+                continue;
+            }
+
+            fc_tag_stats st;
+            get_tag_stats(i, st);
+            if (st.live_bytes <= limit)
+                _tag_over[i] = false;
+            else if (!_tag_over[i])
+            {
+                _tag_over[i] = true;
+                if (fn)
+                    fn(i, st.live_bytes, limit, _tag_limit_arg.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    thread_allocator *get_thread_head()
+    {
+        return _thread_head.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief 一串大小相同的块属于同一个recyclebin，一次加锁放入。区域的大块放入最大的大块bin
+     */
+    void donate_same_bin(block_header *h)
+    {
+        if (h)
+            find_recycle_bin_for(h).cache_batch(h); //set state mergable
+    }
+
+    uint64_t get_epoch()
+    {
+        return _epoch.load();
+    }
+
+    /**
+     * @brief 本地线程调用，把一批退休对象压入无锁栈
+     */
+    void push_retired(retire_batch *b)
+    {
+        retire_batch *stale_head = _retired_head.load(std::memory_order_relaxed);
+        do
+        {
+            b->next = stale_head;
+        } while (!_retired_head.compare_exchange_weak(stale_head, b, std::memory_order_release));
+    }
+
+    /**
+     * @brief 线程退出后才释放的对象，经对象首字串联，由gc线程用自己的分配器释放
+     */
+    void push_orphan(char *p)
+    {
+        char *stale_head = _orphan_head.load(std::memory_order_relaxed);
+        do
+        {
+            *reinterpret_cast<char **>(p) = stale_head;
+        } while (!_orphan_head.compare_exchange_weak(stale_head, p, std::memory_order_release));
+    }
+
+    /**
+     * @brief gc线程调用，释放全部退出后才释放的对象
+     */
+    bool free_orphans()
+    {
+        char *p = _orphan_head.exchange(nullptr, std::memory_order_acquire);
+        if (!p)
+            return false;
+
+        thread_allocator *ta = thread_allocator::get();
+        while (p)
+        {
+            char *nxt = *reinterpret_cast<char **>(p);
+            ta->free(p);
+            p = nxt;
+        }
+        return true;
+    }
+
+    /**
+     * @brief 所有参与的线程都宣布过当前epoch时前进一次
+     */
+    void try_advance_epoch()
+    {
+        uint64_t epoch = _epoch.load();
+        for (thread_allocator *ta = _thread_head.load(std::memory_order_acquire); ta; ta = ta->_next)
+        {
+            uint64_t seen = ta->_quiescent_epoch.load();
+            if (seen != 0 && seen < epoch)
+                return;
+        }
+        _epoch.store(epoch + 1);
+    }
+
+    /**
+     * @brief gc线程调用，释放epoch已前进两次的批，用gc线程自己的分配器批量释放，最后清空它的释放缓冲区
+     */
+    bool reclaim_retired()
+    {
+        retire_batch *fresh = _retired_head.exchange(nullptr, std::memory_order_acquire);
+        while (fresh)
+        {
+            retire_batch *nxt = fresh->next;
+            fresh->next = _retired;
+            _retired = fresh;
+            fresh = nxt;
+        }
+        if (!_retired)
+            return false;
+
+        try_advance_epoch();
+        uint64_t epoch = _epoch.load();
+        thread_allocator *ta = thread_allocator::get();
+        bool freed = false;
+        retire_batch **link = &_retired;
+        while (*link)
+        {
+            retire_batch *b = *link;
+            if (b->epoch + 2 > epoch)
+            {
+                link = &b->next;
+                continue;
+            }
+            *link = b->next;
+            for (size_t i = 0; i < b->num; i++)
+                ta->free(b->ptrs[i]);
+            ta->free(reinterpret_cast<char *>(b));
+            freed = true;
+        }
+
+        // the gc thread frees nothing else, do not leave the objects in its buffer until the next batch
+        if (freed)
+        {
+            std::lock_guard<spin_lock> guard(ta->_cache_lock);
+            ta->flush_free_buffer();
+        }
+        return freed;
+    }
+
+    /**
+     * @brief 找出上次扫描以来没有分配和释放过的线程，回收它们的缓存
+     *
+     *  The caches are taken under the thread's _cache_lock, so a thread that wakes up meanwhile waits for
+     *  us. Its free buffer and the spans it allocates from stay, it is asked to flush those on its next call.
+     */
+    void request_idle_flush()
+    {
+        for (thread_allocator *ta = _thread_head.load(std::memory_order_acquire); ta; ta = ta->_next)
+        {
+            uint64_t epoch = ta->_alloc_epoch.load(std::memory_order_relaxed);
+            if (epoch == ta->_seen_epoch)
+                reclaim_idle(ta);
+            ta->_seen_epoch = epoch;
+        }
+    }
+
+    /**
+     * @brief 取走空闲线程的空单元块、大块一级缓存和二级缓存，线程正在使用缓存时跳过
+     */
+    void reclaim_idle(thread_allocator *ta)
+    {
+        if (!ta->_cache_lock.try_lock())
+            return;
+        if (!ta->_done) // an exiting thread hands its caches over itself
+        {
+            for (size_t l = 0; l < 2; l++)
+            {
+                for (size_t i = 0; i < NUM_SMALL_BINS + 1; i++)
+                {
+                    block_header *span = ta->_empty_span[l][i];
+                    if (!span)
+                        continue;
+                    ta->_empty_span[l][i] = nullptr;
+                    ta->_class_spans[i]--;
+                    unmap_span(span);
+                    span->init_as_queue_node();
+                    donate(span);
+                }
+            }
+            donate(ta->_large_bin_allocator.take_caches());
+            donate(ta->_small_bin_allocator.take_list());
+            donate(ta->_small_bin_allocator.steal());
+            donate(ta->_long_large_bin_allocator.take_caches());
+            donate(ta->_long_small_bin_allocator.take_list());
+            donate(ta->_long_small_bin_allocator.steal());
+            donate(ta->_meta_bin_allocator.take_list());
+            donate(ta->_meta_bin_allocator.steal());
+            ta->_flush_requested.store(true, std::memory_order_relaxed);
+        }
+        ta->_cache_lock.unlock();
+    }
+
+    /**
+     * @brief 新线程从复用池取分配器，池为空时才映射新内存。分配器内存从不解除映射
+     */
+    thread_allocator *acquire_allocator()
+    {
+        {
+            std::lock_guard<spin_lock> guard(_pool_lock);
+            if (thread_allocator *ta = _allocator_pool)
+            {
+                _allocator_pool = ta->_next;
+                return ta;
+            }
+        }
+        return reinterpret_cast<thread_allocator *>(os::mmap_alloc(sizeof(thread_allocator)));
+    }
+
+    /**
+     * @brief 退出线程仍然温热的缓存直接放入对应的recyclebin，不走垃圾回收的慢速路径
+     */
+    void donate(block_header *h)
+    {
+        while (h)
+        {
+            block_header *nxt = h->as_queue_node().next;
+            h->as_queue_node().next = nullptr;
+            find_recycle_bin_for(h).cache_batch(h); //set state mergable
+            h = nxt;
+        }
+    }
+
+    /**
+     * @brief 收集各个recyclebin的统计信息，返回bin的数量
+     */
+    size_t get_bin_stats(fc_bin_stats *out, size_t n)
+    {
+        const size_t num = 2 * (NUM_LARGE_BINS + 1) + 3;
+        for (size_t i = 0; i < num && i < n; i++)
+        {
+            if (i <= NUM_LARGE_BINS)
+                _bins[i].get_stats(out[i]);
+            else if (i <= NUM_LARGE_BINS + 2)
+                (i == NUM_LARGE_BINS + 1 ? _algin_bin : _meta_bin).get_stats(out[i]);
+            else if (i < num - 1)
+                _long_bins[i - NUM_LARGE_BINS - 3].get_stats(out[i]);
+            else
+                _long_algin_bin.get_stats(out[i]);
+        }
+        return num;
+    }
+
+    /**
+     * @brief 单例模式获取类实例
+     */
+    static garbage_collector &get();
+
+    /**
+    * @brief 获取大小类
+    */
+    size_t get_size_class(size_t t)
+    {
+        return smap.get_sizeclass(t);
+    }
+
+    /**
+     * @brief 从非空位图中查找不小于bin的最小大块bin，读取不做同步，只是估计
+     */
+    int find_nonempty_bin(int bin)
+    {
+        bit_index nonempty(_nonempty_bins.load(std::memory_order_relaxed));
+        return nonempty.first_set_bit_from(bin);
+    }
+
+    /**
+     * @brief 从缓存非空位图中查找不小于bin的最小大块bin，它的gc缓存中有块，读取不做同步，只是估计
+     */
+    int find_cached_bin(int bin)
+    {
+        bit_index cached(_cached_bins.load(std::memory_order_relaxed));
+        return cached.first_set_bit_from(bin);
+    }
+
+    /**
+     * @brief 本地线程在ring_buffer上claim失败时清除对应位，避免其他线程重复尝试
+     */
+    void clear_nonempty_bin(int bin)
+    {
+        bit_index mask;
+        mask.set(bin);
+        _nonempty_bins.fetch_and(~mask.bits(), std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 获取按层次搜索recyclebin的跳跃层数
+     */
+    int get_next_recycle_bin(int bin)
+    {
+        return smap.get_next_recycle_bin(bin);
+    }
+
+    //////////////////////////////////////////////////映射相关API-start//////////////////////////////////////////////////
+    /**
+     * @brief 获取bin_info
+     */
+    bin_info &get_bin_info(block_header *h)
+    {
+        return pmap.get(get_number(h));
+    }
+
+    /**
+     * @brief 判断是否存在映射
+     */
+    static inline bool is_mapped(bin_info &binfo)
+    {
+        return binfo.size != 0;
+    }
+
+    /**
+     * @brief 查找单元块的bin_info，不是小块单元块时返回nullptr
+     */
+    bin_info *find_bin_info(block_header *h)
+    {
+        pagemap::Number n = get_number(h);
+        if (!pmap.is_init(n))
+            return nullptr;
+        bin_info &binfo = pmap.get_existing(n);
+        return binfo.size ? &binfo : nullptr;
+    }
+
+    /**
+     * @brief 判断是否初始化映射内部数据结构
+     */
+    bool is_init(block_header *h)
+    {
+        return pmap.is_init(get_number(h));
+    }
+
+    /**
+     * @brief 初始化映射内部数据结构，叶子放在meta_h的数据区。其他线程先初始化了时返回false，meta_h没有用上
+     */
+    bool init(block_header *h, block_header *meta_h)
+    {
+        std::lock_guard<spin_lock> guard(_map_lock);
+        if (pmap.is_init(get_number(h)))
+            return false;
+        pmap.init(get_number(h), meta_h->data());
+        return true;
+    }
+
+    /**
+     * @brief 单元块交给大小类bin时记下对象大小和标签，位图清空
+     */
+    void map_span(block_header *h, int bin, int tag, thread_allocator *owner)
+    {
+        bin_info &binfo = pmap.get_existing(get_number(h));
+        binfo.size = kSizeClasses[bin].size;
+        binfo.tag = tag;
+        binfo.bindex.clear_all();
+        binfo.owner.store(owner, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 单元块还给垃圾回收器前清除映射，之后它可能和相邻的块合并
+     */
+    void unmap_span(block_header *h)
+    {
+        pmap.get_existing(get_number(h)).size = 0;
+    }
+
+    /**
+     * @brief 获取在单元块中偏移量
+     */
+    static inline uint64_t get_pos(block_header *h, int size)
+    {
+        uint64_t ret = reinterpret_cast<uint64_t>(h);
+        return ((ret & (SMALL_BIN_CAPCITY - 1)) - HEDER_SIZE) / size;
+    }
+    /**
+     * @brief 小块对象所在的单元块，单元块按SMALL_BIN_CAPCITY对齐
+     */
+    static inline block_header *get_span(char *c)
+    {
+        return reinterpret_cast<block_header *>(reinterpret_cast<uintptr_t>(c) & ~(uintptr_t)(SMALL_BIN_CAPCITY - 1));
+    }
+    //////////////////////////////////////////////////映射相关API-end//////////////////////////////////////////////////
+
+private:
+    static void run();
+
+    /**
+     * @brief 映射一个大块，切成bytes大小的块，最后一块带上剩余部分，整批放入bin
+     */
+    static void carve_chunk(recycle_bin &bin, size_t bytes, block_header::flags_enum flag)
     {
-        return reinterpret_cast<pagemap::Number>(h) >> SMALL_BIN_SIZE;
+        block_header *head = os::allocate_block_page(CHUNK_SIZE);
+        head->set_state(flag);
+        block_header *h = head;
+        while ((size_t)h->size() >= 2 * bytes + HEDER_SIZE)
+        {
+            block_header *n = h->split_after(bytes);
+            n->set_state(flag);
+            h->as_queue_node().next = n;
+            h = n;
+        }
+        h->as_queue_node().next = nullptr;
+        bin.cache_batch(head);
+    }
+
+    /**
+     * @brief 提高bin的水位下限，batches为0时取消
+     */
+    static void raise_floor(recycle_bin &bin, int64_t batches)
+    {
+        if (batches)
+            bin.raise_floor(batches);
+        else
+            bin.clear_floor();
+    }
+
+    static inline pagemap::Number get_number(block_header *h)
+    {
+        return reinterpret_cast<pagemap::Number>(h) >> SMALL_BIN_BITS;
     }
 
     std::atomic<thread_allocator *> _thread_head; // threads that we are actively looping on and use to release resource
-    std::thread _thread;                          // gc thread.. doing the hard work
+    std::atomic<uint64_t> _epoch;                 // global reclamation epoch, starts at 1
+    std::atomic<retire_batch *> _retired_head;    // batches handed off by threads
+    retire_batch *_retired;                       // batches waiting for the epoch, gc thread only
+    std::atomic<char *> _orphan_head;             // objects freed by threads after their allocator was destroyed
+    spin_lock _pool_lock;
+    spin_lock _map_lock;                          // serializes creating pagemap leaves
+    thread_allocator *_allocator_pool;            // allocators of exited threads, reused by new threads
+    uint64_t _near_hits, _near_misses;            // alloc_near stats of exited threads, under _pool_lock
+    int64_t _class_bytes[NUM_SMALL_BINS + 1];     // small class counters of exited threads, under _pool_lock
+    int64_t _class_spans[NUM_SMALL_BINS + 1];
+    std::atomic<int64_t> _class_util_pct[NUM_SMALL_BINS + 1]; // refreshed by the gc thread every DEFRAG_STATS_MS
+    fc_tag_stats _tag_stats[FC_MAX_TAGS];                     // tag counters of exited threads, under _pool_lock
+    std::atomic<int64_t> _tag_limit[FC_MAX_TAGS];             // soft limits in bytes, 0 for none
+    bool _tag_over[FC_MAX_TAGS];                              // above the limit at the last check, gc thread only
+    std::atomic<fc_tag_limit_fn> _tag_limit_fn;
+    std::atomic<void *> _tag_limit_arg;
+    garbage_collect *_dirty;                      // dirty threads taken from the queue but not visited yet
+    block_header *_backlog;                       // garbage left over when a pass ran out of budget
+    pthread_t _thread;                            // gc thread.. doing the hard work
     static std::atomic<bool> _done;               //use to notice gc thread over
     recycle_bin _bins[NUM_LARGE_BINS + 1];
+    std::atomic<uint64_t> _nonempty_bins; // bins whose ring_buffer holds blocks, written by gc thread only
+    std::atomic<uint64_t> _cached_bins;   // bins whose gc cache holds blocks, written under the bin's _list_lock
+    static_assert(NUM_LARGE_BINS + 1 <= 64, "one bit per large bin");
     recycle_bin _algin_bin, _meta_bin;
+    recycle_bin _long_bins[NUM_LARGE_BINS + 1]; // long lived blocks, no nonempty bitmap
+    recycle_bin _long_algin_bin;                // spans of long lived small objects
+    medium_heap _medium_heap; // blocks above LARGE_BLOCK, page runs of reserved regions
+    huge_cache _huge_cache;   // blocks above MEDIUM_BLOCK, served by their own mappings
     sizemap smap;
     pagemap pmap;
 };
 
-std::atomic<bool> garbage_collector::_done(false);
+inline std::atomic<bool> garbage_collector::_done(false);
 
-garbage_collector &garbage_collector::get()
+inline __thread thread_allocator *thread_allocator::_tld = nullptr;
+inline __thread bool thread_allocator::_exiting = false;
+
+inline garbage_collector &garbage_collector::get()
 {
     static garbage_collector gc;
     return gc;
 }
 
-void garbage_collector::run()
+inline void garbage_collector::run()
 {
     try
     {
         garbage_collector &self = garbage_collector::get();
+        std::chrono::steady_clock::time_point last_idle_scan = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point last_util_refresh = last_idle_scan;
+        std::chrono::steady_clock::time_point last_tag_check = last_idle_scan;
 
         while (true)
         {
-            thread_allocator *cur_al = *((thread_allocator **)&self._thread_head);
             bool found_work = false;
+            int pressure = os::pressure();
+            recycle_bin::set_pressure(pressure);
+            int64_t budget = options::get(FC_OPT_GC_WORK_BUDGET);
+            std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::now() + std::chrono::microseconds(options::get(FC_OPT_GC_TIME_BUDGET_US));
+
+            //先处理上一轮没做完的垃圾
+            if (self._backlog)
+            {
+                found_work = true;
+                self._backlog = self.collect(self._backlog, budget, deadline);
+            }
 
-            //遍历注册线程,回收垃圾
-            while (cur_al)
+            //只访问发布了垃圾的线程，上一批脏线程都访问过才取新的一批，预算用完就把剩下的留到下一轮
+            if (!self._dirty)
+                self._dirty = garbage_collect::take_dirty();
+            while (self._dirty && budget > 0 && !self._backlog)
             {
-                //拿到其垃圾，并尝试在整个recyclebin范围内去合并，将合并后的大块放入对应recyclebin的缓存中
-                block_header *cur = cur_al->_garbage_collect.get_garbage();
+                garbage_collect *gcollect = self._dirty;
+                self._dirty = gcollect->dirty_next();
 
+                //拿到其垃圾，并尝试在整个recyclebin范围内去合并，将合并后的大块放入对应recyclebin的缓存中
+                bool retired;
+                block_header *cur = gcollect->take_notified_garbage(retired);
+                if (retired) // the thread exited and this was its last visit
+                    self.unregister_allocator(gcollect);
                 if (cur)
-                    found_work = true;
-
-                while (cur)
                 {
-                    block_header *nxt = cur->as_queue_node().next;
-                    cur->set_state(block_header::mergable); //set state mergable
-                    self.merge_block(cur);
-                    self.find_recycle_bin_for(cur).cache_block(cur);
-                    cur = nxt;
+                    found_work = true;
+                    self._backlog = self.collect(cur, budget, deadline);
                 }
-
-                // get the next thread.
-                cur_al = cur_al->_next;
             }
 
-            //全局池中生产
+            //释放已经安全的退休对象
+            if (self.reclaim_retired())
+                found_work = true;
+            if (self.free_orphans())
+                found_work = true;
+
+            //全局池中生产，并发布非空位图
+            bit_index nonempty;
             for (size_t i = 0; i <= NUM_LARGE_BINS; i++)
             {
                 if (self._bins[i].produce_block_to_ring_buffer())
                     found_work = true;
+                if (self._bins[i].available() > 0)
+                    nonempty.set(i);
             }
+            self._nonempty_bins.store(nonempty.bits(), std::memory_order_relaxed);
             self._algin_bin.produce_block_to_ring_buffer();
             self._meta_bin.produce_block_to_ring_buffer();
+            for (size_t i = 0; i <= NUM_LARGE_BINS; i++)
+            {
+                if (self._long_bins[i].produce_block_to_ring_buffer())
+                    found_work = true;
+            }
+            self._long_algin_bin.produce_block_to_ring_buffer();
+
+            //长期没有需求的bin不论堆上限都归还整个大块
+            for (size_t i = 0; i <= NUM_LARGE_BINS; i++)
+            {
+                self.unmap_idle_cache(self._bins[i]);
+                self.unmap_idle_cache(self._long_bins[i]);
+            }
+            self.unmap_idle_cache(self._algin_bin);
+            self.unmap_idle_cache(self._long_algin_bin);
 
-            //重新声明全局池，寻找自适应算法检测ring_buffer满的
-            if (!found_work)
+            //水位模式下补充缓存，超过堆上限时不再映射
+            if (pressure < 2 && self.prefill())
+                found_work = true;
+
+            //重新声明全局池，寻找自适应算法检测ring_buffer满的。接近堆上限时每轮都做
+            if (!found_work || pressure)
             {
                 for (size_t i = 0; i <= NUM_LARGE_BINS; i++)
                     self._bins[i].reclaim_ring_buffer();
                 self._algin_bin.reclaim_ring_buffer();
                 self._meta_bin.reclaim_ring_buffer();
+                for (size_t i = 0; i <= NUM_LARGE_BINS; i++)
+                    self._long_bins[i].reclaim_ring_buffer();
+                self._long_algin_bin.reclaim_ring_buffer();
+                self._medium_heap.trim();
             }
+            if (pressure)
+                self._huge_cache.trim(pressure > 1 ? 0 : HUGE_CACHE_COMMIT_BYTES / 4);
 
-            if (!found_work)
+            //定期扫描所有线程，只在空闲时进行。接近堆上限时忙也扫描，间隔缩短
+            int64_t idle_ms = options::get(FC_OPT_THREAD_IDLE_MS) >> (2 * pressure);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if ((!found_work || pressure) && idle_ms > 0 && now - last_idle_scan > std::chrono::milliseconds(idle_ms))
+            {
+                self.request_idle_flush();
+                last_idle_scan = now;
+            }
+
+            //定期汇总小块大小类的利用率，供fc_should_move判断
+            if (now - last_util_refresh > std::chrono::milliseconds(DEFRAG_STATS_MS))
+            {
+                self.refresh_class_util();
+                last_util_refresh = now;
+            }
+
+            //定期检查标签的软上限
+            if (now - last_tag_check > std::chrono::milliseconds(TAG_CHECK_MS))
+            {
+                self.check_tag_limits();
+                last_tag_check = now;
+            }
+
+            if (!found_work && !recycle_bin::starving())
                 usleep(1000);
 
             if (_done.load(std::memory_order_acquire))
@@ -367,8 +1433,223 @@ void garbage_collector::run()
     }
 }
 
-void thread_allocator::free(char *c)
+inline thread_allocator *thread_allocator::get()
+{
+    if (!_tld)
+    {
+        _tld = thread_allocator::create();
+
+        //allocate pthread_threadlocal var, attach a destructor /clean up callback to that variable
+        thread_local thread_allocator_gc tlv;
+    }
+    return _tld;
+}
+
+inline void thread_allocator::thread_free(char *c)
+{
+    if (c == nullptr)
+        return;
+    if (_tld || !_exiting)
+        get()->free(c);
+    else
+        garbage_collector::get().push_orphan(c);
+}
+
+inline void thread_allocator::thread_free_sized(char *c, size_t s, size_t align)
+{
+    if (c == nullptr)
+        return;
+    if (_tld || !_exiting)
+        get()->free_sized(c, s, align);
+    else
+        garbage_collector::get().push_orphan(c);
+}
+
+inline thread_allocator *thread_allocator::create()
+{
+    thread_allocator *tp = garbage_collector::get().acquire_allocator();
+    thread_allocator::constructor(tp);
+    return tp;
+}
+
+inline void thread_allocator::release(thread_allocator *tp)
+{
+    thread_allocator::destructor(tp);
+}
+
+inline void thread_allocator::quiescent()
+{
+    _quiescent_epoch.store(garbage_collector::get().get_epoch());
+    hand_off_retired();
+}
+
+inline void thread_allocator::hand_off_retired()
+{
+    if (!_retire_batch)
+        return;
+    garbage_collector &gc = garbage_collector::get();
+    _retire_batch->epoch = gc.get_epoch();
+    gc.push_retired(_retire_batch);
+    _retire_batch = nullptr;
+}
+
+inline void thread_allocator::constructor(thread_allocator *tp)
+{
+    tp->_done = false;
+    tp->_next = nullptr;
+    tp->_prev = nullptr;
+    tp->_alloc_epoch.store(0, std::memory_order_relaxed);
+    tp->_seen_epoch = 0;
+    tp->_flush_requested = false;
+    tp->_free_num = 0;
+    tp->_quiescent_epoch = 0;
+    tp->_retire_batch = nullptr;
+    memset(tp->_empty_span, 0, sizeof(tp->_empty_span));
+    tp->_lifetime = 0;
+    tp->_near_hits = 0;
+    tp->_near_misses = 0;
+    memset(tp->_partial_span, 0, sizeof(tp->_partial_span));
+    memset(tp->_class_bytes, 0, sizeof(tp->_class_bytes));
+    memset(tp->_class_spans, 0, sizeof(tp->_class_spans));
+    tp->_tag = 0;
+    memset(tp->_tag_bytes, 0, sizeof(tp->_tag_bytes));
+    memset(tp->_tag_allocs, 0, sizeof(tp->_tag_allocs));
+    memset(tp->_tag_frees, 0, sizeof(tp->_tag_frees));
+    tp->_garbage_collect.constructor(tp);
+    tp->_large_bin_allocator.constructor();
+    tp->_small_bin_allocator.constructor();
+    tp->_long_large_bin_allocator.constructor();
+    tp->_long_small_bin_allocator.constructor();
+    tp->_meta_bin_allocator.constructor();
+    garbage_collector::get().register_allocator(tp);
+}
+
+inline void thread_allocator::destructor(thread_allocator *tp)
+{
+    tp->_done = 1;
+
+    //交出退休对象，不再阻挡epoch前进
+    tp->hand_off_retired();
+    tp->_quiescent_epoch.store(0);
+
+    //仍然温热的缓存直接还给全局池
+    tp->flush_caches();
+
+    // spans in the small front caches and partial slots may still hold objects, orphaned they are given back by their last free
+    garbage_collector &gc = garbage_collector::get();
+    tp->_cache_lock.lock();
+    for (size_t l = 0; l < 2; l++)
+    {
+        for (size_t i = 0; i < NUM_SMALL_BINS + 1; i++)
+        {
+            block_header *span = tp->small_allocator(l).get_cache(i);
+            tp->small_allocator(l).clear_cache(i);
+            if (span)
+                tp->unclaim_span(span, i, gc.get_bin_info(span));
+
+            span = tp->_partial_span[l][i];
+            tp->_partial_span[l][i] = nullptr;
+            if (span)
+                tp->unclaim_span(span, i, gc.get_bin_info(span));
+        }
+    }
+    tp->_small_bin_allocator.destructor(tp->_garbage_collect);
+    tp->_long_small_bin_allocator.destructor(tp->_garbage_collect);
+    tp->_meta_bin_allocator.destructor(tp->_garbage_collect);
+    tp->_cache_lock.unlock();
+
+    // tp belongs to the gc thread from here on, it is reused once the rest of our garbage is drained
+    if (_tld == tp)
+    {
+        _tld = nullptr;
+        _exiting = true;
+    }
+    tp->_garbage_collect.retire();
+}
+
+inline void thread_allocator::flush_caches()
+{
+    garbage_collector &gc = garbage_collector::get();
+    _flush_requested.store(false, std::memory_order_relaxed);
+
+    std::lock_guard<spin_lock> guard(_cache_lock);
+    flush_free_buffer();
+    for (size_t l = 0; l < 2; l++)
+    {
+        for (size_t i = 0; i < NUM_SMALL_BINS + 1; i++)
+        {
+            if (_empty_span[l][i])
+                release_span(_empty_span[l][i], i);
+            _empty_span[l][i] = nullptr;
+        }
+    }
+    gc.donate(_large_bin_allocator.take_caches());
+    gc.donate(_small_bin_allocator.take_list());
+    gc.donate(_small_bin_allocator.steal());
+    gc.donate(_long_large_bin_allocator.take_caches());
+    gc.donate(_long_small_bin_allocator.take_list());
+    gc.donate(_long_small_bin_allocator.steal());
+    gc.donate(_meta_bin_allocator.take_list());
+    gc.donate(_meta_bin_allocator.steal());
+    _garbage_collect.hand_over(); // frees still on deck would wait for our next free
+}
+
+template <typename allocator_t>
+inline block_header *thread_allocator::steal_from_siblings(allocator_t thread_allocator::*member)
+{
+    //从下一个线程开始探测，分散饥饿线程。分配器内存从不解除映射，跟随_next走到已退出的线程也是安全的
+    int64_t victims = options::get(FC_OPT_STEAL_VICTIMS);
+    thread_allocator *head = garbage_collector::get().get_thread_head();
+    thread_allocator *ta = _next ? _next : head;
+    for (int64_t i = 0; ta && i < victims; i++)
+    {
+        if (ta != this)
+        {
+            if (block_header *h = (ta->*member).steal())
+                return h;
+        }
+        ta = ta->_next ? ta->_next : head;
+    }
+    return nullptr;
+}
+
+inline void thread_allocator::flush_free_buffer()
+{
+    garbage_collector &gc = garbage_collector::get();
+    std::sort(_free_buffer, _free_buffer + _free_num);
+
+    for (size_t i = 0; i < _free_num;)
+    {
+        block_header *span = garbage_collector::get_span(_free_buffer[i]);
+        bin_info &binfo = gc.get_bin_info(span);
+        int bin = gc.get_size_class(binfo.size);
+        bool was_full = binfo.bindex.count() == binfo.capacity();
+        int flag_empty = 0;
+        size_t freed = 0;
+        for (; i < _free_num && garbage_collector::get_span(_free_buffer[i]) == span; i++, freed++)
+            binfo.free(garbage_collector::get_pos(reinterpret_cast<block_header *>(_free_buffer[i]), binfo.size), flag_empty);
+        _class_bytes[bin] -= freed * binfo.size;
+        _tag_bytes[binfo.tag] -= freed * binfo.size;
+        _tag_frees[binfo.tag] += freed;
+        if (flag_empty)
+        {
+            //单元块可能在其他线程的缓存中，占有它之后才能交出
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (claim_span(binfo))
+                release_empty_span(span, bin);
+        }
+        else if (was_full)
+            keep_partial_span(span, bin, binfo);
+    }
+    _free_num = 0;
+}
+
+inline void thread_allocator::free(char *c)
 {
+    if (_flush_requested.load(std::memory_order_relaxed))
+        flush_caches();
+    bump_epoch();
+
     ////////////////////////////////////////////小块内存释放-start////////////////////////////////////////////
     block_header *h = reinterpret_cast<block_header *>(c);
 
@@ -376,55 +1657,125 @@ void thread_allocator::free(char *c)
     bin_info &binfo = gc.get_bin_info(h);
 
     if (garbage_collector::is_mapped(binfo))
-        free_small(c, binfo);
+    {
+        free_small(c);
+        return;
+    }
     ////////////////////////////////////////////小块内存释放-end////////////////////////////////////////////
 
+    free_large(c);
+}
+
+inline void thread_allocator::free_sized(char *c, size_t s, size_t align)
+{
+    if (_flush_requested.load(std::memory_order_relaxed))
+        flush_caches();
+    bump_epoch();
+
+    //对齐分配可能来自小块、大块或者中等块中的对齐位置，按地址查找。大小为0时调用者不知道大小，同样按地址查找
+    if (align > MIN_BLOCK_SIZE || s == 0)
+        free(c);
+    else if (s <= SMALL_BLOCK)
+        free_small(c);
+    else
+        free_large(c);
+}
+
+inline void thread_allocator::free_large(char *c)
+{
+    garbage_collector &gc = garbage_collector::get();
+
     ////////////////////////////////////////////大块内存释放-start////////////////////////////////////////////
     //尝试大块释放,直接加入垃圾回收区中
-    h = reinterpret_cast<block_header *>(c - HEDER_SIZE);
-    if (h->size() <= LARGE_BLOCK)
+    block_header *h = reinterpret_cast<block_header *>(c - HEDER_SIZE);
+    if (h->is_offset()) // an aligned pointer inside the block, see alloc_aligned
+    {
+        c = h->offset_base();
+        h = reinterpret_cast<block_header *>(c - HEDER_SIZE);
+    }
+    if (h->is_arena())
+    {
+        fprintf(stderr, "fc_malloc: free() of arena memory %p\n", c);
+        abort();
+    }
+    _tag_bytes[h->get_tag()] -= block_bytes(h);
+    _tag_frees[h->get_tag()]++;
+    if (!h->is_bigdata() && h->size() <= LARGE_BLOCK)
     {
         _garbage_collect.release(h);
         return;
     }
     ////////////////////////////////////////////大块内存释放-end////////////////////////////////////////////
 
+    ////////////////////////////////////////////中等块内存释放-start////////////////////////////////////////////
+    //页段交给垃圾回收器合并
+    if (h->size() != 0)
+    {
+        _garbage_collect.release(h);
+        return;
+    }
+    ////////////////////////////////////////////中等块内存释放-end////////////////////////////////////////////
+
     ////////////////////////////////////////////巨大块内存释放-start////////////////////////////////////////////
-    os::mmap_free(h, h->size() + HEDER_SIZE);
+    gc.get_huge_cache().release(huge_header::from_block(h));
     ////////////////////////////////////////////巨大块内存释放-end////////////////////////////////////////////
     return;
 }
 
-char *thread_allocator::alloc(size_t s)
+inline char *thread_allocator::alloc_block(size_t s, int flags)
 {
     if (s == 0)
         return nullptr;
+    if (_flush_requested.load(std::memory_order_relaxed))
+        flush_caches();
+    bump_epoch();
     if (s < MIN_BLOCK_SIZE)
         s = MIN_BLOCK_SIZE;
 
+    std::lock_guard<spin_lock> guard(_cache_lock);
     garbage_collector &gc = garbage_collector::get();
-    block_header *h, *new_page, *tail;
+    block_header *h;
+
+    //按寿命类别选择单元块池和大块集合，没有指定时用本线程的默认值
+    int lifetime = (flags & (FC_LONG_LIVED | FC_TRANSIENT)) ? flags : _lifetime;
+    bool long_lived = (lifetime & FC_LONG_LIVED) != 0;
 
     ////////////////////////////////////////////小块内存分配-start////////////////////////////////////////////
     if (s <= SMALL_BLOCK)
     {
         int bin = gc.get_size_class(s);
+        small_allocator_t &small = small_allocator(long_lived);
 
         //尝试调用前端一级缓存，成功直接返回
-        h = _small_bin_allocator.get_cache(bin);
+        h = small.get_cache(bin);
         if (h)
             return alloc_small(bin, h, gc.get_bin_info(h));
 
-        //重新提取一个单元块
-        h = _small_bin_allocator.fetch_block_from_second_cache_above(bin, gc.get_align_bin(), _garbage_collect, block_header::alignblock, ALIGN_CHUNK_SIZE, LIST_CACHE_NUM);
-
-        //尝试建立映射
-        if (!gc.is_init(h))
+        //先复用保留的空单元块，映射已经建立
+        h = _empty_span[long_lived][bin];
+        if (h)
         {
-            block_header *meta_h = _meta_bin_allocator.fetch_block_from_second_cache_above(1, gc.get_meta_bin(), _garbage_collect, block_header::metablock, META_CHUNK_SIZE, LIST_CACHE_NUM / 2);
-            gc.init(h, meta_h);
+            _empty_span[long_lived][bin] = nullptr;
+            small.store_cache(h, bin);
+            bin_info &binfo = gc.get_bin_info(h);
+            binfo.tag = _tag;
+            return alloc_small(bin, h, binfo);
         }
 
+        //重新提取一个单元块
+        if (long_lived)
+            h = small.fetch_block_from_second_cache_above(gc.get_align_bin(true), _garbage_collect, (block_header::flags_enum)(block_header::alignblock | block_header::longlived), ALIGN_CHUNK_SIZE, list_cache_num(LIST_CACHE_NUM),
+                                                          [this] { return steal_from_siblings(&thread_allocator::_long_small_bin_allocator); });
+        else
+            h = small.fetch_block_from_second_cache_above(gc.get_align_bin(), _garbage_collect, block_header::alignblock, ALIGN_CHUNK_SIZE, list_cache_num(LIST_CACHE_NUM),
+                                                          [this] { return steal_from_siblings(&thread_allocator::_small_bin_allocator); });
+
+        //尝试建立映射，放入一级缓存
+        init_span_mapping(h);
+        _class_spans[bin]++;
+        gc.map_span(h, bin, _tag, this);
+        small.store_cache(h, bin);
+
         //重新分配
         return alloc_small(bin, h, gc.get_bin_info(h));
     ////////////////////////////////////////////小块内存分配-end////////////////////////////////////////////
@@ -432,41 +1783,390 @@ char *thread_allocator::alloc(size_t s)
     ////////////////////////////////////////////大块内存分配-start////////////////////////////////////////////
     else if (s + HEDER_SIZE < LARGE_BLOCK)
     {
-        //多层次调用bin
-        int min_bin = gc.get_size_class(s + HEDER_SIZE);
-        min_bin -= NUM_SMALL_BINS;
-        for (int bin = min_bin; bin <= NUM_BINS; bin += gc.get_next_recycle_bin(bin))
+        s = (s + MIN_BLOCK_SIZE - 1) & ~(size_t)(MIN_BLOCK_SIZE - 1); // keep the next header aligned
+        if (long_lived)
+            return alloc_large_long_lived(s);
+
+        int min_bin = gc.get_size_class(s + HEDER_SIZE) - NUM_SMALL_BINS;
+        char *p;
+
+        //多层次查找本线程一级缓存，不需要原子操作
+        for (int bin = min_bin; bin <= NUM_LARGE_BINS; bin += gc.get_next_recycle_bin(bin + NUM_SMALL_BINS))
+        {
+            h = _large_bin_allocator.fetch_cache(bin);
+            if (h && (p = split_large(h, s)))
+                return p;
+        }
+
+        //通过非空位图找到能满足请求的最小bin，不在空的ring_buffer上claim
+        for (int bin = gc.find_nonempty_bin(min_bin); bin <= NUM_LARGE_BINS; bin = gc.find_nonempty_bin(bin + 1))
         {
-            h = _large_bin_allocator.fetch_block_from_front_and_middle(bin, gc);
+            h = _large_bin_allocator.fetch_block_from_middle(gc.get_bin(bin + NUM_SMALL_BINS));
             if (h)
             {
-                tail = h->split_after(s);
-                if (bin != min_bin && !_large_bin_allocator.store_cache(h, bin))
-                {
-                    _garbage_collect.release(tail);
-                }
-                return h->data();
+                //同一批的其余内存块留在一级缓存
+                if (!_large_bin_allocator.store_batch(h->as_queue_node().next, bin))
+                    _garbage_collect.release_batch(h->as_queue_node().next);
+                if ((p = split_large(h, s)))
+                    return p;
+                continue;
             }
+            gc.clear_nonempty_bin(bin); // other threads drained it since the last gc pass
         }
 
-        //调用后端并切割
-        new_page = os::allocate_block_page(CHUNK_SIZE);
-        tail = new_page->split_after(s);
+        //慢速路径：没有发布的批也是需求，记下后直接从gc缓存中取，最小的bin没有时切割更大的缓存块
+        gc.get_bin(min_bin + NUM_SMALL_BINS).note_miss();
+        for (int bin = gc.find_cached_bin(min_bin); bin <= NUM_LARGE_BINS; bin = gc.find_cached_bin(bin + 1))
+        {
+            recycle_bin &rbin = gc.get_bin(bin + NUM_SMALL_BINS);
+            if (bin != min_bin)
+                rbin.note_miss(); // its blocks are wanted, publish them from now on
+            h = rbin.pull_cached_batch(options::get(FC_OPT_REFILL_SPINS));
+            if (h)
+            {
+                if (!_large_bin_allocator.store_batch(h->as_queue_node().next, bin))
+                    _garbage_collect.release_batch(h->as_queue_node().next);
+                if ((p = split_large(h, s)))
+                    return p;
+            }
+        }
 
-        if (tail && !_large_bin_allocator.store_cache(tail, gc.get_size_class(tail->size())))
+        //gc缓存也都空了，取回gc线程还没来取的自己的释放，再等待gc生产
+        h = _garbage_collect.take_on_deck(s, ON_DECK_SCAN);
+        if (!h && _garbage_collect.take_back_at_bat())
+            h = _garbage_collect.take_on_deck(s, ON_DECK_SCAN);
+        if (h && (p = split_large(h, s)))
+            return p;
+        h = gc.get_bin(min_bin + NUM_SMALL_BINS).wait_for_batch(options::get(FC_OPT_REFILL_WAIT_US));
+        if (h)
         {
-            _garbage_collect.release(tail);
+            if (!_large_bin_allocator.store_batch(h->as_queue_node().next, min_bin))
+                _garbage_collect.release_batch(h->as_queue_node().next);
+            if ((p = split_large(h, s)))
+                return p;
         }
 
-        return new_page->data();
+        //调用后端并切割
+        return split_large(os::allocate_block_page(CHUNK_SIZE), s);
     ////////////////////////////////////////////大块内存分配-end////////////////////////////////////////////
     }
+    ////////////////////////////////////////////中等块内存分配-start////////////////////////////////////////////
+    else if (s + HEDER_SIZE <= MEDIUM_BLOCK)
+    {
+        return gc.get_medium_heap().alloc(s, flags & FC_POPULATE);
+    ////////////////////////////////////////////中等块内存分配-end////////////////////////////////////////////
+    }
     ////////////////////////////////////////////巨大块内存分配-start////////////////////////////////////////////
     else
     {
-        new_page = os::allocate_block_page(s + HEDER_SIZE);
-        new_page->set_state(block_header::bigdata);
-        return new_page->data();
+        return gc.get_huge_cache().alloc(s, flags & FC_POPULATE);
     }
     ////////////////////////////////////////////巨大块内存分配-end////////////////////////////////////////////
-}
\ No newline at end of file
+}
+
+inline char *thread_allocator::alloc_aligned(size_t s, size_t align)
+{
+    if (align <= MIN_BLOCK_SIZE)
+        return alloc(s);
+    if (align <= 2 * MIN_BLOCK_SIZE && s + HEDER_SIZE <= SMALL_BLOCK)
+        return alloc(s + HEDER_SIZE) + HEDER_SIZE; // free finds the object by its span offset, the skipped word does not matter
+    if (align > INT32_MAX)
+        throw std::bad_alloc();
+
+    //多分配align字节，保证切下的前部至少能放下queue_state
+    size_t front = HEDER_SIZE + sizeof(block_header::queue_state);
+    size_t need = std::max(s + align + front, (size_t)SMALL_BLOCK + 1); // take the large path
+    if (need + HEDER_SIZE >= LARGE_BLOCK)
+    {
+        //中等块和巨大块不能切开，在对齐位置前写一个指回块首的块头
+        char *c = alloc(s + align + HEDER_SIZE);
+        uintptr_t p = (reinterpret_cast<uintptr_t>(c) + HEDER_SIZE + align - 1) & ~(uintptr_t)(align - 1);
+        reinterpret_cast<block_header *>(p - HEDER_SIZE)->mark_offset(p - reinterpret_cast<uintptr_t>(c));
+        return reinterpret_cast<char *>(p);
+    }
+
+    char *c = alloc_block(need, 0);
+    block_header *h = reinterpret_cast<block_header *>(c - HEDER_SIZE);
+    uintptr_t p = (reinterpret_cast<uintptr_t>(c) + front + align - 1) & ~(uintptr_t)(align - 1);
+    block_header *n = h->split_after(p - HEDER_SIZE - reinterpret_cast<uintptr_t>(c));
+    _garbage_collect.release(h);
+    charge_large(n->data());
+    return n->data();
+}
+
+inline void thread_allocator::alloc_batch(size_t s, size_t n, char **out)
+{
+    if (s < MIN_BLOCK_SIZE)
+        s = MIN_BLOCK_SIZE;
+    if (s > SMALL_BLOCK)
+    {
+        for (size_t i = 0; i < n; i++)
+            out[i] = alloc(s);
+        return;
+    }
+
+    garbage_collector &gc = garbage_collector::get();
+    int bin = gc.get_size_class(s);
+    for (size_t i = 0; i < n;)
+    {
+        //一级缓存为空时走一次完整的分配来重新填充
+        block_header *h = _small_bin_allocator.get_cache(bin);
+        if (!h)
+        {
+            out[i++] = alloc(s, FC_TRANSIENT);
+            continue;
+        }
+
+        bump_epoch();
+        std::lock_guard<spin_lock> guard(_cache_lock);
+        bin_info &binfo = gc.get_bin_info(h);
+        while (i < n && _small_bin_allocator.get_cache(bin) == h)
+            out[i++] = alloc_small(bin, h, binfo);
+    }
+}
+
+inline void thread_allocator::init_span_mapping(block_header *h)
+{
+    garbage_collector &gc = garbage_collector::get();
+    if (!gc.is_init(h))
+    {
+        block_header *meta_h = _meta_bin_allocator.fetch_block_from_second_cache_above(gc.get_meta_bin(), _garbage_collect, block_header::metablock, META_CHUNK_SIZE, LIST_CACHE_NUM / 2,
+                                                                                       [this] { return steal_from_siblings(&thread_allocator::_meta_bin_allocator); });
+        if (!gc.init(h, meta_h))
+            _meta_bin_allocator.store_list(meta_h); // another thread created the leaf meanwhile
+    }
+}
+
+inline char *thread_allocator::alloc_near(const char *hint, size_t s)
+{
+    if (!hint || s == 0)
+        return alloc(s);
+    if (s < MIN_BLOCK_SIZE)
+        s = MIN_BLOCK_SIZE;
+
+    garbage_collector &gc = garbage_collector::get();
+    char *c = const_cast<char *>(hint);
+    block_header *span = garbage_collector::get_span(c);
+    bool small_hint = gc.find_bin_info(span) != nullptr;
+    std::unique_lock<spin_lock> guard(_cache_lock);
+
+    if (s <= SMALL_BLOCK && small_hint)
+    {
+        int bin = gc.get_size_class(s);
+        small_allocator_t &small = small_allocator(span->is_longlived());
+        block_header *cached = small.get_cache(bin);
+
+        //hint所在单元块正是本线程的一级缓存
+        if (cached == span)
+        {
+            _near_hits++;
+            bump_epoch();
+            return alloc_small(bin, span, gc.get_bin_info(span));
+        }
+
+        //一级缓存为空时，取hint旁边在全局池中的空闲单元块。别的线程缓存的单元块不能碰
+        if (!cached)
+        {
+            block_header *around[2] = {span->next(), span->prev()};
+            for (int i = 0; i < 2; i++)
+            {
+                block_header *nb = around[i];
+                if (!nb || nb->size() != SMALL_BIN_SIZE || !nb->is_aligned() || nb->is_longlived() != span->is_longlived() || !nb->is_mergable())
+                    continue;
+                if (!gc.take_cached_block(nb, i ? span : nullptr))
+                    continue;
+
+                init_span_mapping(nb);
+                _class_spans[bin]++;
+                gc.map_span(nb, bin, _tag, this);
+                small.store_cache(nb, bin);
+                _near_hits++;
+                bump_epoch();
+                return alloc_small(bin, nb, gc.get_bin_info(nb));
+            }
+        }
+    }
+    else if (s > SMALL_BLOCK && s + HEDER_SIZE < LARGE_BLOCK)
+    {
+        //hint旁边在全局池中的空闲大块
+        s = (s + MIN_BLOCK_SIZE - 1) & ~(size_t)(MIN_BLOCK_SIZE - 1);
+        block_header *h = small_hint ? span : reinterpret_cast<block_header *>(c - HEDER_SIZE); // a span is a block too
+        block_header *around[2] = {h->is_bigdata() ? nullptr : h->next(), h->is_bigdata() ? nullptr : h->prev()};
+        for (int i = 0; i < 2; i++)
+        {
+            block_header *nb = around[i];
+            // spans are only cut at span boundaries, leave them to the span bins
+            if (!nb || nb->is_bigdata() || nb->is_aligned() || !nb->is_mergable() || (size_t)nb->size() < s)
+                continue;
+            if (!gc.take_cached_block(nb, i ? h : nullptr))
+                continue;
+            if ((size_t)nb->size() < s || nb->is_aligned()) // the gc changed it before we took it
+            {
+                _garbage_collect.release(nb);
+                continue;
+            }
+
+            _near_hits++;
+            bump_epoch();
+            char *p = split_large(nb, s);
+            charge_large(p);
+            return p;
+        }
+    }
+
+    _near_misses++;
+    guard.unlock();
+    return alloc(s);
+}
+
+inline void thread_allocator::release_span(block_header *span, int bin)
+{
+    _class_spans[bin]--;
+    garbage_collector::get().unmap_span(span);
+    _garbage_collect.release(span);
+}
+
+inline void thread_allocator::keep_partial_span(block_header *span, int bin, bin_info &binfo)
+{
+    garbage_collector &gc = garbage_collector::get();
+    block_header *&slot = _partial_span[span->is_longlived()][bin];
+    if (slot == span || (slot && gc.get_bin_info(slot).bindex.count() >= binfo.bindex.count()))
+        return;
+
+    //其他线程已经占有的单元块不记，它的最后一次释放由占有者处理
+    if (!claim_span(binfo))
+        return;
+    block_header *old = slot;
+    slot = span;
+    if (old)
+        unclaim_span(old, bin, gc.get_bin_info(old));
+}
+
+inline bool thread_allocator::should_move(const char *p)
+{
+    garbage_collector &gc = garbage_collector::get();
+    block_header *span = garbage_collector::get_span(const_cast<char *>(p));
+    bin_info *binfo = gc.find_bin_info(span);
+    if (!binfo)
+        return false; // large blocks are not moved
+
+    //本线程正在填充的单元块会变满，不需要搬空
+    int bin = gc.get_size_class(binfo->size);
+    bool long_lived = span->is_longlived();
+    if (span == small_allocator(long_lived).get_cache(bin) || span == _partial_span[long_lived][bin])
+        return false;
+
+    uint64_t capacity = binfo->capacity();
+    if (binfo->bindex.count() * DEFRAG_SPARSE_RATIO > capacity)
+        return false;
+    return gc.get_class_util_pct(bin) < DEFRAG_MAX_UTIL_PCT;
+}
+
+inline char *thread_allocator::alloc_for_move(size_t s)
+{
+    if (s == 0 || s > SMALL_BLOCK)
+        return alloc(s);
+    if (s < MIN_BLOCK_SIZE)
+        s = MIN_BLOCK_SIZE;
+
+    garbage_collector &gc = garbage_collector::get();
+    int bin = gc.get_size_class(s);
+    bool long_lived = (_lifetime & FC_LONG_LIVED) != 0;
+    small_allocator_t &small = small_allocator(long_lived);
+    std::unique_lock<spin_lock> guard(_cache_lock);
+    block_header *cached = small.get_cache(bin);
+    block_header *partial = _partial_span[long_lived][bin];
+
+    //记下的单元块比一级缓存更满时换过来，一级缓存的单元块留到下次
+    if (partial && partial != cached)
+    {
+        bin_info &binfo = gc.get_bin_info(partial);
+        if (!cached || binfo.bindex.count() > gc.get_bin_info(cached).bindex.count())
+        {
+            _partial_span[long_lived][bin] = cached;
+            small.clear_cache(bin);
+            small.store_cache(partial, bin);
+            bump_epoch();
+            return alloc_small(bin, partial, binfo);
+        }
+    }
+    guard.unlock();
+    return alloc(s);
+}
+
+inline void thread_allocator::warmup(size_t s, size_t count)
+{
+    //对象串成链表，第一个字存放下一个
+    char *list = nullptr;
+    for (size_t i = 0; i < count; i++)
+    {
+        char *p = alloc(std::max(s, sizeof(char *)), FC_POPULATE);
+        memset(p, 0, s);
+        *reinterpret_cast<char **>(p) = list;
+        list = p;
+    }
+    while (list)
+    {
+        char *nxt = *reinterpret_cast<char **>(list);
+        free_sized(list, std::max(s, sizeof(char *)));
+        list = nxt;
+    }
+    std::lock_guard<spin_lock> guard(_cache_lock);
+    flush_free_buffer();
+}
+
+inline char *thread_allocator::alloc_large_long_lived(size_t s)
+{
+    garbage_collector &gc = garbage_collector::get();
+    int min_bin = gc.get_size_class(s + HEDER_SIZE) - NUM_SMALL_BINS;
+    block_header *h;
+    char *p;
+
+    //多层次查找本线程一级缓存
+    for (int bin = min_bin; bin <= NUM_LARGE_BINS; bin += gc.get_next_recycle_bin(bin + NUM_SMALL_BINS))
+    {
+        h = _long_large_bin_allocator.fetch_cache(bin);
+        if (h && (p = split_large(h, s)))
+            return p;
+    }
+
+    //长寿命的bin没有非空位图，只在最小的bin上claim，再直接从gc缓存中取
+    recycle_bin &rbin = gc.get_bin(min_bin + NUM_SMALL_BINS, true);
+    h = _long_large_bin_allocator.fetch_block_from_middle(rbin);
+    if (!h)
+        h = rbin.pull_cached_batch(options::get(FC_OPT_REFILL_SPINS));
+    if (h)
+    {
+        if (!_long_large_bin_allocator.store_batch(h->as_queue_node().next, min_bin))
+            _garbage_collect.release_batch(h->as_queue_node().next);
+        if ((p = split_large(h, s)))
+            return p;
+    }
+
+    //新大块只给长寿命对象用
+    h = os::allocate_block_page(CHUNK_SIZE);
+    h->set_state(block_header::longlived);
+    return split_large(h, s);
+}
+
+inline char *thread_allocator::split_large(block_header *h, size_t s)
+{
+    if ((size_t)h->size() < s)
+    {
+        _garbage_collect.release(h);
+        return nullptr;
+    }
+
+    //剩余部分放不下queue_state时留在块中，否则会写到下一个块头上
+    if ((size_t)h->size() >= s + HEDER_SIZE + sizeof(block_header::queue_state))
+    {
+        block_header *tail = h->split_after(s);
+        int tail_bin = garbage_collector::get().get_large_bin(tail->size());
+        tail->init_as_queue_node();
+        if (tail_bin == 0 || !large_allocator(h->is_longlived()).store_cache(tail, tail_bin))
+            _garbage_collect.release(tail); // fragments go to the gc, which merges them with their neighbours
+    }
+    return h->data();
+}
+
+#endif